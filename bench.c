@@ -0,0 +1,745 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <threads.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+#include "cexitstack.h"
+#include "cexitstack_compact.h"
+#include "cexitstack_concurrent.h"
+#include "cexitstack_persist.h"
+#include "cexitstack_pool.h"
+#include "cexitstack_reclaim.h"
+#ifndef CEXITSTACK_NO_GLIB
+#include "gexitstack.h"
+#endif
+
+#define BENCH_TOTAL_PUSHES 10000000
+
+enum { BENCH_FORMAT_TEXT, BENCH_FORMAT_CSV, BENCH_FORMAT_JSON };
+static int bench_format = BENCH_FORMAT_TEXT;
+
+// Built with BENCH_WRAP_MALLOC and linked with --wrap=malloc,--wrap=calloc,--wrap=realloc (see
+// CMakeLists.txt), every allocation made by code linked into the benchmark is counted per thread.
+// Allocations inside shared libraries (GLib) aren't seen.
+#ifdef BENCH_WRAP_MALLOC
+static _Thread_local unsigned long long bench_allocations;
+void *__real_malloc( size_t size );
+void *__real_calloc( size_t count, size_t size );
+void *__real_realloc( void *pointer, size_t size );
+
+void *__wrap_malloc( size_t size )
+{
+    bench_allocations++;
+    return __real_malloc( size );
+}
+
+void *__wrap_calloc( size_t count, size_t size )
+{
+    bench_allocations++;
+    return __real_calloc( count, size );
+}
+
+void *__wrap_realloc( void *pointer, size_t size )
+{
+    bench_allocations++;
+    return __real_realloc( pointer, size );
+}
+#endif
+
+// one measurement: params is a space separated list of key=value pairs
+static void bench_result( const char *bench, const char *metric, const char *unit, double value, const char *params_format, ... )
+{
+    char params[128];
+    va_list args;
+    va_start( args, params_format );
+    vsnprintf( params, sizeof( params ), params_format, args );
+    va_end( args );
+    switch (bench_format) {
+    case BENCH_FORMAT_CSV:
+        printf( "%s,%s,%s,%.3f,%s\n", bench, params, metric, value, unit );
+        break;
+    case BENCH_FORMAT_JSON:
+        printf( "{\"bench\":\"%s\",\"params\":\"%s\",\"metric\":\"%s\",\"value\":%.3f,\"unit\":\"%s\"}\n", bench, params, metric, value, unit );
+        break;
+    default:
+        printf( "%-12s %-40s %-18s %12.2f %s\n", bench, params, metric, value, unit );
+    }
+}
+
+static double bench_now( void )
+{
+    struct timespec ts;
+    timespec_get( &ts, TIME_UTC );
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void bench_func_noop( void *object )
+{
+    (void)object;
+}
+
+static unsigned int bench_rounds( unsigned int n )
+{
+    unsigned int rounds = BENCH_TOTAL_PUSHES / n;
+    return rounds ? rounds : 1;
+}
+
+void bench_push( const char *name, unsigned int n, unsigned int growth, int reserve )
+{
+    unsigned int rounds = bench_rounds( n );
+    double start = bench_now();
+    for (unsigned int r = 0; r < rounds; r++) {
+        cexitstack stack;
+        if (!cexitstack_init( &stack, 0 )) abort();
+        cexitstack_set_growth( &stack, growth );
+        if (reserve && !cexitstack_reserve( &stack, n )) abort();
+        for (unsigned int i = 0; i < n; i++)
+            if (!cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &bench_func_noop )) abort();
+        cexitstack_return( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    }
+    double elapsed = bench_now() - start;
+    double pushes = (double)rounds * n;
+    bench_result( "push", "push", "ns/push", elapsed * 1e9 / pushes, "policy=%s n=%u", name, n );
+}
+
+// only the pushes are timed, onto a stack that already has room for them
+void bench_push_only( unsigned int n )
+{
+    unsigned int rounds = bench_rounds( n );
+    double elapsed = 0;
+    cexitstack stack;
+    if (!cexitstack_init( &stack, n )) abort();
+    for (unsigned int r = 0; r < rounds; r++) {
+        double start = bench_now();
+        for (unsigned int i = 0; i < n; i++)
+            if (!cexitstack_push_full( &stack, (void *)(uintptr_t)i, CEXITSTACK_CONDITION_ERROR, &bench_func_noop )) abort();
+        elapsed += bench_now() - start;
+        cexitstack_unwind_to( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    }
+    cexitstack_free( &stack );
+    bench_result( "push_only", "push", "ns/push", elapsed * 1e9 / ( (double)rounds * n ), "n=%u", n );
+}
+
+void bench_push_inline( unsigned int n )
+{
+    unsigned int rounds = bench_rounds( n );
+    double start = bench_now();
+    for (unsigned int r = 0; r < rounds; r++) {
+        CEXITSTACK_INLINE( stack, 16 );
+        for (unsigned int i = 0; i < n; i++)
+            if (!cexitstack_push_full( &stack.stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &bench_func_noop )) abort();
+        cexitstack_return( &stack.stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    }
+    double elapsed = bench_now() - start;
+    double pushes = (double)rounds * n;
+    bench_result( "push", "push", "ns/push", elapsed * 1e9 / pushes, "policy=inline16 n=%u", n );
+}
+
+void bench_push_many( unsigned int n )
+{
+    unsigned int rounds = bench_rounds( n );
+    void **objects = calloc( n, sizeof( void * ) );
+    if (!objects) abort();
+    double start = bench_now();
+    for (unsigned int r = 0; r < rounds; r++) {
+        cexitstack stack;
+        if (!cexitstack_init( &stack, 0 )) abort();
+        if (!cexitstack_push_many( &stack, objects, n, CEXITSTACK_CONDITION_ALWAYS, &bench_func_noop )) abort();
+        cexitstack_return( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    }
+    double elapsed = bench_now() - start;
+    double pushes = (double)rounds * n;
+    bench_result( "push", "push", "ns/push", elapsed * 1e9 / pushes, "policy=many n=%u", n );
+    free( objects );
+}
+
+static void bench_func_noop2( void *object )
+{
+    (void)object;
+}
+
+// push n items with 1 in match_every matching the unwind condition, then return
+void bench_layout( unsigned int n, unsigned int match_every )
+{
+    unsigned int rounds = bench_rounds( n );
+    double start = bench_now();
+    for (unsigned int r = 0; r < rounds; r++) {
+        cexitstack stack;
+        if (!cexitstack_init( &stack, n )) abort();
+        for (unsigned int i = 0; i < n; i++)
+            cexitstack_push_full( &stack, NULL, i % match_every ? 2 : 1, i % 2 ? &bench_func_noop : &bench_func_noop2 );
+        cexitstack_return( &stack, 0, 1 );
+    }
+    double aos = bench_now() - start;
+    start = bench_now();
+    for (unsigned int r = 0; r < rounds; r++) {
+        cexitstack_compact stack;
+        if (!cexitstack_compact_init( &stack, n )) abort();
+        for (unsigned int i = 0; i < n; i++)
+            cexitstack_compact_push_full( &stack, NULL, i % match_every ? 2 : 1, i % 2 ? &bench_func_noop : &bench_func_noop2 );
+        cexitstack_compact_return( &stack, 0, 1 );
+    }
+    double soa = bench_now() - start;
+    double items = (double)rounds * n;
+    bench_result( "layout", "push+return", "ns/item", aos * 1e9 / items, "flavor=cexitstack n=%u match=1/%u", n, match_every );
+    bench_result( "layout", "push+return", "ns/item", soa * 1e9 / items, "flavor=compact n=%u match=1/%u", n, match_every );
+    bench_result( "layout", "item_size", "B", (double)sizeof( cexitstack_item ), "flavor=cexitstack" );
+    bench_result( "layout", "item_size", "B", (double)( sizeof( void * ) + sizeof( unsigned int ) + sizeof( unsigned char ) ), "flavor=compact" );
+}
+
+// unwind only: n items in runs of 16 sharing a function, match_percent of them matching the condition
+void bench_unwind_sweep( unsigned int n, unsigned int match_percent )
+{
+    unsigned int rounds = bench_rounds( n );
+    double aos = 0, soa = 0;
+    for (unsigned int r = 0; r < rounds; r++) {
+        cexitstack stack;
+        cexitstack_compact compact;
+        if (!cexitstack_init( &stack, n ) || !cexitstack_compact_init( &compact, n )) abort();
+        for (unsigned int i = 0; i < n; i++) {
+            unsigned int condition = ( i * 37 ) % 100 < match_percent ? 1 : 2;
+            cexitstack_func *func = ( i / 16 ) % 2 ? &bench_func_noop : &bench_func_noop2;
+            cexitstack_push_full( &stack, NULL, condition, func );
+            cexitstack_compact_push_full( &compact, NULL, condition, func );
+        }
+        double start = bench_now();
+        cexitstack_return( &stack, 0, 1 );
+        double middle = bench_now();
+        cexitstack_compact_return( &compact, 0, 1 );
+        double end = bench_now();
+        aos += middle - start;
+        soa += end - middle;
+    }
+    double items = (double)rounds * n;
+    bench_result( "unwind", "return", "ns/item", aos * 1e9 / items, "flavor=cexitstack n=%u match=%u%%", n, match_percent );
+    bench_result( "unwind", "return", "ns/item", soa * 1e9 / items, "flavor=compact n=%u match=%u%%", n, match_percent );
+}
+
+static void bench_func_free_wrapped( void *object )
+{
+    if (object) free( object );
+}
+
+// unwinding n malloc'd buffers through cexitstack_func_free (batched) or an equivalent wrapper
+void bench_free_run( unsigned int n )
+{
+    unsigned int rounds = bench_rounds( n ) / 10 + 1;
+    double batched = 0, wrapped = 0;
+    for (unsigned int r = 0; r < rounds; r++) {
+        for (int pass = 0; pass < 2; pass++) {
+            cexitstack stack;
+            if (!cexitstack_init( &stack, n )) abort();
+            for (unsigned int i = 0; i < n; i++)
+                cexitstack_push_full( &stack, malloc( 32 ), CEXITSTACK_CONDITION_ALWAYS, pass ? &bench_func_free_wrapped : &cexitstack_func_free );
+            double start = bench_now();
+            cexitstack_return( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+            *( pass ? &wrapped : &batched ) += bench_now() - start;
+        }
+    }
+    double items = (double)rounds * n;
+    bench_result( "free_run", "return", "ns/item", batched * 1e9 / items, "func=cexitstack_func_free n=%u", n );
+    bench_result( "free_run", "return", "ns/item", wrapped * 1e9 / items, "func=wrapper n=%u", n );
+}
+
+#ifndef _WIN32
+static void bench_func_close_wrapped( void *object )
+{
+    close( (int)(intptr_t)object );
+}
+
+// closing n descriptors (dup'd in order) through the close kind or a generic callback
+void bench_close_run( unsigned int n )
+{
+    unsigned int rounds = 200;
+    double kind = 0, wrapped = 0;
+    for (unsigned int r = 0; r < rounds; r++) {
+        for (int pass = 0; pass < 2; pass++) {
+            cexitstack stack;
+            if (!cexitstack_init( &stack, n )) abort();
+            for (unsigned int i = 0; i < n; i++) {
+                int fd = dup( 0 );
+                if (fd < 0) abort();
+                if (pass) cexitstack_push_full( &stack, (void *)(intptr_t)fd, CEXITSTACK_CONDITION_ALWAYS, &bench_func_close_wrapped );
+                else cexitstack_push_fd( &stack, fd, CEXITSTACK_CONDITION_ALWAYS );
+            }
+            double start = bench_now();
+            cexitstack_return( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+            *( pass ? &wrapped : &kind ) += bench_now() - start;
+        }
+    }
+    double items = (double)rounds * n;
+    bench_result( "close_run", "return", "ns/item", kind * 1e9 / items, "func=kind n=%u", n );
+    bench_result( "close_run", "return", "ns/item", wrapped * 1e9 / items, "func=wrapper n=%u", n );
+}
+#endif
+
+// a construction path registering k rollback actions that succeeds: error items pushed onto the stack
+// and skipped by the final return, or pushed with cexitstack_push_rollback and dropped by cexitstack_commit
+void bench_commit( unsigned int k )
+{
+    unsigned int rounds = bench_rounds( k ) / 10 + 1;
+    double pushes[2] = { 0 }, finishes[2] = { 0 };
+    cexitstack stack;
+    if (!cexitstack_init( &stack, 0 )) abort();
+    for (unsigned int r = 0; r < rounds; r++) {
+        for (int pass = 0; pass < 2; pass++) {
+            double start = bench_now();
+            cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &bench_func_noop );
+            for (unsigned int i = 0; i < k; i++) {
+                if (pass) cexitstack_push_rollback( &stack, (void *)(uintptr_t)i, CEXITSTACK_CONDITION_ERROR, &bench_func_noop );
+                else cexitstack_push_full( &stack, (void *)(uintptr_t)i, CEXITSTACK_CONDITION_ERROR, &bench_func_noop );
+            }
+            cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &bench_func_noop );
+            double pushed = bench_now();
+            if (pass) cexitstack_commit( &stack );
+            cexitstack_reset( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+            pushes[pass] += pushed - start;
+            finishes[pass] += bench_now() - pushed;
+        }
+    }
+    cexitstack_free( &stack );
+    for (int pass = 0; pass < 2; pass++) {
+        const char *mode = pass ? "commit" : "skip";
+        bench_result( "commit", "push", "ns/request", pushes[pass] * 1e9 / rounds, "mode=%s k=%u", mode, k );
+        bench_result( "commit", "finish", "ns/request", finishes[pass] * 1e9 / rounds, "mode=%s k=%u", mode, k );
+    }
+}
+
+#ifndef _WIN32
+// appending n unlink entries to a persistent stack, synced every sync_batch pushes (0: only at the end)
+void bench_persist( unsigned int n, unsigned int sync_batch )
+{
+    static char names[256][32];
+    for (unsigned int i = 0; i < 256; i++)
+        snprintf( names[i], sizeof( names[i] ), "/nonexistent/bench%u", i );
+    char path[64];
+    snprintf( path, sizeof( path ), "/tmp/cexitstack_bench_%ld.log", (long)getpid() );
+    unsigned int rounds = 20;
+    double pushes = 0, syncs = 0;
+    for (unsigned int r = 0; r < rounds; r++) {
+        cexitstack_persist *stack = cexitstack_persist_open( path, (size_t)n * 64, sync_batch );
+        if (!stack) abort();
+        double start = bench_now();
+        for (unsigned int i = 0; i < n; i++)
+            if (!cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, names[i % 256], CEXITSTACK_CONDITION_ERROR )) abort();
+        double pushed = bench_now();
+        if (!cexitstack_persist_sync( stack )) abort();
+        pushes += pushed - start;
+        syncs += bench_now() - pushed;
+        cexitstack_persist_return( stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    }
+    unlink( path );
+    bench_result( "persist", "push", "ns/push", pushes * 1e9 / ( (double)rounds * n ), "n=%u sync_batch=%u", n, sync_batch );
+    bench_result( "persist", "final_sync", "us", syncs * 1e6 / rounds, "n=%u sync_batch=%u", n, sync_batch );
+}
+#endif
+
+// per-request cost of k cleanups: a fresh stack per request vs one stack reset after each request
+void bench_request( unsigned int k )
+{
+    unsigned int rounds = BENCH_TOTAL_PUSHES / k;
+    double start = bench_now();
+    for (unsigned int r = 0; r < rounds; r++) {
+        cexitstack *stack = cexitstack_new( 0 );
+        if (!stack) abort();
+        for (unsigned int i = 0; i < k; i++)
+            cexitstack_push_full( stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &bench_func_noop );
+        cexitstack_return( stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    }
+    double fresh = bench_now() - start;
+    cexitstack stack;
+    if (!cexitstack_init( &stack, 0 )) abort();
+    cexitstack_set_shrink( &stack, 64 );
+    start = bench_now();
+    for (unsigned int r = 0; r < rounds; r++) {
+        for (unsigned int i = 0; i < k; i++)
+            cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &bench_func_noop );
+        cexitstack_reset( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    }
+    double reset = bench_now() - start;
+    cexitstack_free( &stack );
+    bench_result( "request", "request", "ns/request", fresh * 1e9 / rounds, "mode=new/return k=%u", k );
+    bench_result( "request", "request", "ns/request", reset * 1e9 / rounds, "mode=reset k=%u", k );
+}
+
+#define BENCH_CONCURRENT_MAX_THREADS 16
+
+typedef struct
+{
+    cexitstack_concurrent *concurrent;
+    cexitstack *locked;
+    mtx_t *lock;
+    unsigned int pushes;
+} bench_concurrent_args;
+
+static int bench_concurrent_worker( void *arg )
+{
+    bench_concurrent_args *args = arg;
+    for (unsigned int i = 0; i < args->pushes; i++) {
+        if (args->concurrent) {
+            cexitstack_concurrent_push_full( args->concurrent, NULL, CEXITSTACK_CONDITION_ALWAYS, &bench_func_noop );
+        }
+        else {
+            mtx_lock( args->lock );
+            cexitstack_push_full( args->locked, NULL, CEXITSTACK_CONDITION_ALWAYS, &bench_func_noop );
+            mtx_unlock( args->lock );
+        }
+    }
+    return 0;
+}
+
+// total push throughput of a fixed number of pushes spread over 1..n threads
+static double bench_concurrent_run( unsigned int threads, int concurrent )
+{
+    thrd_t workers[BENCH_CONCURRENT_MAX_THREADS];
+    bench_concurrent_args args;
+    mtx_t lock;
+    cexitstack locked;
+    cexitstack_concurrent stack;
+    mtx_init( &lock, mtx_plain );
+    if (!cexitstack_init( &locked, 0 ) || !cexitstack_concurrent_init( &stack )) abort();
+    args = ( bench_concurrent_args ){ .concurrent = concurrent ? &stack : NULL, .locked = &locked, .lock = &lock, .pushes = BENCH_TOTAL_PUSHES / threads };
+    double start = bench_now();
+    for (unsigned int t = 0; t < threads; t++)
+        if (thrd_create( workers + t, &bench_concurrent_worker, &args ) != thrd_success) abort();
+    for (unsigned int t = 0; t < threads; t++)
+        thrd_join( workers[t], NULL );
+    double elapsed = bench_now() - start;
+    cexitstack_concurrent_return( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    cexitstack_return( &locked, 0, CEXITSTACK_CONDITION_ALWAYS );
+    mtx_destroy( &lock );
+    return (double)args.pushes * threads / elapsed * 1e-6;
+}
+
+void bench_concurrent( unsigned int max_threads )
+{
+    for (unsigned int threads = 1; threads <= max_threads && threads <= BENCH_CONCURRENT_MAX_THREADS; threads *= 2) {
+        bench_result( "concurrent", "throughput", "Mpush/s", bench_concurrent_run( threads, 1 ), "mode=lock-free threads=%u", threads );
+        bench_result( "concurrent", "throughput", "Mpush/s", bench_concurrent_run( threads, 0 ), "mode=mutex threads=%u", threads );
+    }
+}
+
+// a cleanup with some real work in it, about a microsecond
+static void bench_func_busy( void *object )
+{
+    volatile unsigned int sink = (unsigned int)(uintptr_t)object;
+    for (unsigned int i = 0; i < 500; i++)
+        sink = sink * 31 + i;
+}
+
+static void bench_func_slow( void *object )
+{
+    volatile unsigned int sink = (unsigned int)(uintptr_t)object;
+    for (unsigned int i = 0; i < 200000; i++)
+        sink = sink * 31 + i;
+}
+
+// Unwinding 1000 cheap cleanups and a few slow ones in slices of at most 50 us, with and without
+// cost estimates. A slice that stops before running anything leaves the slow item on top; the
+// bench then runs it outside the slices, as a caller offloading it would.
+void bench_budget( void )
+{
+    cexitstack_costs costs = { 0 };
+    for (int pass = 0; pass < 3; pass++) {
+        cexitstack stack;
+        if (!cexitstack_init( &stack, 0 )) abort();
+        for (unsigned int i = 0; i < 1000; i++)
+            cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, i % 200 == 100 ? &bench_func_slow : &bench_func_busy );
+        cexitstack_budget budget = { .max_ns = 50000, .costs = pass ? &costs : NULL };
+        cexitstack_budget one = { .max_items = 1, .costs = &costs };
+        double worst = 0;
+        unsigned int slices = 0, offloaded = 0;
+        for (;;) {
+            unsigned int length = stack.length;
+            double start = bench_now();
+            int done = cexitstack_unwind_budget( &stack, 0, CEXITSTACK_CONDITION_ALWAYS, &budget );
+            double elapsed = bench_now() - start;
+            if (elapsed > worst) worst = elapsed;
+            slices++;
+            if (done < 0) abort();
+            if (done) break;
+            if (stack.length == length) {
+                cexitstack_unwind_budget( &stack, 0, CEXITSTACK_CONDITION_ALWAYS, &one );
+                offloaded++;
+            }
+        }
+        cexitstack_free( &stack );
+        // the second pass learns the estimates the third one starts with
+        if (pass == 1) continue;
+        const char *mode = pass ? "estimates" : "plain";
+        bench_result( "budget", "worst_slice", "us", worst * 1e6, "mode=%s budget=50us", mode );
+        bench_result( "budget", "slices", "count", slices, "mode=%s budget=50us", mode );
+        bench_result( "budget", "offloaded", "count", offloaded, "mode=%s budget=50us", mode );
+    }
+}
+
+// unwinding n independent cleanups on the calling thread vs spread over a pool of 1..n threads
+void bench_parallel( unsigned int n, unsigned int max_threads )
+{
+    for (unsigned int threads = 0; threads <= max_threads; threads = threads ? threads * 2 : 1) {
+        cexitstack_pool *pool = threads ? cexitstack_pool_new( threads ) : NULL;
+        if (threads && !pool) abort();
+        cexitstack stack;
+        if (!cexitstack_init( &stack, n )) abort();
+        for (unsigned int i = 0; i < n; i++)
+            cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_INDEPENDENT | CEXITSTACK_CONDITION_ALWAYS, &bench_func_busy );
+        double start = bench_now();
+        cexitstack_return_parallel( &stack, 0, CEXITSTACK_CONDITION_ALWAYS, pool );
+        double elapsed = bench_now() - start;
+        cexitstack_pool_free( pool );
+        bench_result( "parallel", "return", "ms", elapsed * 1e3, "n=%u workers=%u", n, threads );
+    }
+}
+
+static int bench_compare_double( const void *a, const void *b )
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return ( x > y ) - ( x < y );
+}
+
+// handler latency (push k busy cleanups, return) with cleanups run inline vs handed to a reclaimer
+void bench_deferred( unsigned int k )
+{
+    enum { requests = 20000 };
+    static double latencies[requests];
+    for (int deferred = 0; deferred < 2; deferred++) {
+        cexitstack_reclaimer *reclaimer = deferred ? cexitstack_reclaimer_new( 0 ) : NULL;
+        if (deferred && !reclaimer) abort();
+        double total_start = bench_now();
+        for (unsigned int r = 0; r < requests; r++) {
+            double start = bench_now();
+            cexitstack stack;
+            if (!cexitstack_init( &stack, k )) abort();
+            for (unsigned int i = 0; i < k; i++)
+                cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &bench_func_busy );
+            cexitstack_return_deferred( &stack, 0, CEXITSTACK_CONDITION_ALWAYS, reclaimer );
+            latencies[r] = bench_now() - start;
+        }
+        cexitstack_reclaimer_free( reclaimer );
+        double total = bench_now() - total_start;
+        qsort( latencies, requests, sizeof( *latencies ), &bench_compare_double );
+        const char *mode = deferred ? "deferred" : "inline";
+        bench_result( "deferred", "latency_p50", "us", latencies[requests / 2] * 1e6, "mode=%s k=%u", mode, k );
+        bench_result( "deferred", "latency_p99", "us", latencies[requests * 99 / 100] * 1e6, "mode=%s k=%u", mode, k );
+        bench_result( "deferred", "total_with_drain", "ms", total * 1e3, "mode=%s k=%u", mode, k );
+    }
+}
+
+void bench_new_return( const char *name, int arena )
+{
+    unsigned int rounds = BENCH_TOTAL_PUSHES / 10;
+    if (arena) cexitstack_arena_enable();
+    double start = bench_now();
+    for (unsigned int r = 0; r < rounds; r++) {
+        cexitstack *stack = cexitstack_new( 0 );
+        if (!stack) abort();
+        cexitstack_push_full( stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &bench_func_noop );
+        cexitstack_return( stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    }
+    double elapsed = bench_now() - start;
+    if (arena) cexitstack_arena_disable();
+    bench_result( "new_return", "new+return", "ns/stack", elapsed * 1e9 / rounds, "alloc=%s", name );
+}
+
+// Same job in every flavor: push depth items (hit_percent of them matching the unwind condition)
+// and return. The flavor functions store the time their push phase ended in bench_flavor_pushed.
+#define BENCH_FLAVOR_MAX_DEPTH 256
+static double bench_flavor_pushed;
+static double bench_clock_overhead;
+static int bench_flavor_resource;
+
+static unsigned int bench_flavor_condition( unsigned int i, unsigned int hit_percent )
+{
+    return ( i * 37 ) % 100 < hit_percent ? 1 : 2;
+}
+
+static void *bench_flavor_acquire( void )
+{
+    return &bench_flavor_resource;
+}
+
+static int bench_flavor_cexitstack( unsigned int depth, unsigned int hit_percent, cexitstack_func *func )
+{
+    cexitstack *stack = cexitstack_new( 0 );
+    if (!stack) return 1;
+    for (unsigned int i = 0; i < depth; i++)
+        if (!cexitstack_push_full( stack, bench_flavor_acquire(), bench_flavor_condition( i, hit_percent ), func ))
+            return cexitstack_return( stack, 1, CEXITSTACK_CONDITION_ERROR );
+    bench_flavor_pushed = bench_now();
+    return cexitstack_return( stack, 0, 1 );
+}
+
+static int bench_flavor_macro( unsigned int depth, unsigned int hit_percent, cexitstack_func *func )
+{
+    CEXITSTACK( stack, BENCH_FLAVOR_MAX_DEPTH );
+    for (unsigned int i = 0; i < depth; i++)
+        CEXITSTACK_PUSH( stack, bench_flavor_acquire(), bench_flavor_condition( i, hit_percent ), func );
+    bench_flavor_pushed = bench_now();
+    CEXITSTACK_RETURN( stack, 0, 1 );
+}
+
+#ifndef CEXITSTACK_NO_GLIB
+static int bench_flavor_gexitstack( unsigned int depth, unsigned int hit_percent, cexitstack_func *func )
+{
+    gexitstack *stack = gexitstack_new();
+    for (unsigned int i = 0; i < depth; i++)
+        gexitstack_push_full( stack, bench_flavor_acquire(), bench_flavor_condition( i, hit_percent ), func );
+    bench_flavor_pushed = bench_now();
+    return gexitstack_return( stack, 0, 1 );
+}
+
+// gexitstack as it was before it got its own array: a cleared GArray, g_array_append_vals per push
+// and every item written back after its cleanup ran, kept to compare against
+static int bench_flavor_garray( unsigned int depth, unsigned int hit_percent, cexitstack_func *func )
+{
+    GArray *stack = g_array_sized_new( FALSE, TRUE, sizeof( gexitstack_item ), GEXITSTACK_DEFAULT_INITIAL_CAPACITY );
+    for (unsigned int i = 0; i < depth; i++) {
+        const gexitstack_item new_item = ( gexitstack_item ){ .object = bench_flavor_acquire(), .condition = bench_flavor_condition( i, hit_percent ), .func = func };
+        g_array_append_vals( stack, &new_item, 1 );
+    }
+    bench_flavor_pushed = bench_now();
+    for (guint i = stack->len; i > 0; i--) {
+        gexitstack_item *item = &g_array_index( stack, gexitstack_item, i - 1 );
+        if (item->condition != GEXITSTACK_CONDITION_ALWAYS && !( 1 & item->condition )) continue;
+        g_clear_pointer( &item->object, item->func );
+        item->condition = 0;
+        item->func = NULL;
+    }
+    g_array_unref( stack );
+    return 0;
+}
+#endif
+
+// hand-written error handling: the conditions are known where the cleanup code is, nothing is stored
+static int bench_flavor_goto( unsigned int depth, unsigned int hit_percent, cexitstack_func *func )
+{
+    void *objects[BENCH_FLAVOR_MAX_DEPTH];
+    unsigned int acquired = 0;
+    int result = 1;
+    for (; acquired < depth; acquired++) {
+        objects[acquired] = bench_flavor_acquire();
+        if (!objects[acquired]) goto cleanup;
+    }
+    bench_flavor_pushed = bench_now();
+    result = 0;
+cleanup:
+    while (acquired-- > 0)
+        if (bench_flavor_condition( acquired, hit_percent ) == 1)
+            ( *func )( objects[acquired] );
+    return result;
+}
+
+typedef int bench_flavor_func( unsigned int depth, unsigned int hit_percent, cexitstack_func *func );
+
+static void bench_flavor( const char *flavor, bench_flavor_func *run, int count_allocations, unsigned int depth, unsigned int hit_percent,
+                          const char *callback, cexitstack_func *func, unsigned int items )
+{
+    unsigned int rounds = items / depth ? items / depth : 1;
+    double push = 0, unwind = 0;
+#ifdef BENCH_WRAP_MALLOC
+    unsigned long long allocations = bench_allocations;
+#endif
+    for (unsigned int r = 0; r < rounds; r++) {
+        double start = bench_now();
+        if (( *run )( depth, hit_percent, func )) abort();
+        double end = bench_now();
+        push += bench_flavor_pushed - start - bench_clock_overhead;
+        unwind += end - bench_flavor_pushed - bench_clock_overhead;
+    }
+    double pushes = (double)rounds * depth;
+    bench_result( "flavors", "push", "ns/item", push * 1e9 / pushes, "flavor=%s depth=%u hit=%u%% callback=%s", flavor, depth, hit_percent, callback );
+    bench_result( "flavors", "unwind", "ns/item", unwind * 1e9 / pushes, "flavor=%s depth=%u hit=%u%% callback=%s", flavor, depth, hit_percent, callback );
+#ifdef BENCH_WRAP_MALLOC
+    if (count_allocations)
+        bench_result( "flavors", "allocations", "allocs/op", (double)( bench_allocations - allocations ) / rounds, "flavor=%s depth=%u hit=%u%% callback=%s",
+                      flavor, depth, hit_percent, callback );
+#else
+    (void)count_allocations;
+#endif
+}
+
+void bench_flavors( void )
+{
+    double start = bench_now();
+    for (int i = 0; i < 1000; i++)
+        bench_flavor_pushed = bench_now();
+    bench_clock_overhead = ( bench_flavor_pushed - start ) / 1000;
+    unsigned int depths[] = { 4, 32, 256 };
+    unsigned int hit_percents[] = { 0, 50, 100 };
+    for (unsigned int d = 0; d < sizeof( depths ) / sizeof( *depths ); d++) {
+        for (unsigned int h = 0; h < sizeof( hit_percents ) / sizeof( *hit_percents ); h++) {
+            for (int busy = 0; busy < 2; busy++) {
+                const char *callback = busy ? "busy" : "noop";
+                cexitstack_func *func = busy ? &bench_func_busy : &bench_func_noop;
+                unsigned int items = busy ? 200000 : 2000000;
+                bench_flavor( "cexitstack", &bench_flavor_cexitstack, 1, depths[d], hit_percents[h], callback, func, items );
+                bench_flavor( "macro", &bench_flavor_macro, 1, depths[d], hit_percents[h], callback, func, items );
+#ifndef CEXITSTACK_NO_GLIB
+                // gexitstack allocates inside libglib, where the wrapped malloc doesn't reach
+                bench_flavor( "gexitstack", &bench_flavor_gexitstack, 0, depths[d], hit_percents[h], callback, func, items );
+                bench_flavor( "garray", &bench_flavor_garray, 0, depths[d], hit_percents[h], callback, func, items );
+#endif
+                bench_flavor( "goto", &bench_flavor_goto, 1, depths[d], hit_percents[h], callback, func, items );
+            }
+        }
+    }
+}
+
+int main( int argc, char **argv )
+{
+    unsigned int max_threads = 8;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp( argv[i], "--format=csv" ))
+            bench_format = BENCH_FORMAT_CSV;
+        else if (!strcmp( argv[i], "--format=json" ))
+            bench_format = BENCH_FORMAT_JSON;
+        else if (!strcmp( argv[i], "--format=text" ))
+            bench_format = BENCH_FORMAT_TEXT;
+        else if (argv[i][0] >= '0' && argv[i][0] <= '9')
+            max_threads = (unsigned int)atoi( argv[i] );
+        else {
+            fprintf( stderr, "usage: %s [--format=text|csv|json] [max_threads]\n", argv[0] );
+            return 2;
+        }
+    }
+    if (bench_format == BENCH_FORMAT_CSV)
+        printf( "bench,params,metric,value,unit\n" );
+    bench_flavors();
+    unsigned int sizes[] = { 10, 1000, 100000 };
+    for (unsigned int i = 0; i < sizeof( sizes ) / sizeof( *sizes ); i++) {
+        bench_push( "linear", sizes[i], CEXITSTACK_DEFAULT_CAPACITY_INCREMENT, 0 );
+        bench_push( "geometric", sizes[i], CEXITSTACK_GROWTH_GEOMETRIC, 0 );
+        bench_push( "reserve", sizes[i], CEXITSTACK_GROWTH_GEOMETRIC, 1 );
+        bench_push_inline( sizes[i] );
+        bench_push_many( sizes[i] );
+    }
+    bench_push_only( 1000 );
+    bench_layout( 10000, 1 );
+    bench_layout( 10000, 100 );
+    unsigned int match_percents[] = { 0, 1, 10, 50, 100 };
+    for (unsigned int i = 0; i < sizeof( match_percents ) / sizeof( *match_percents ); i++)
+        bench_unwind_sweep( 10000, match_percents[i] );
+    bench_free_run( 10000 );
+#ifndef _WIN32
+    bench_close_run( 256 );
+    bench_persist( 10000, 0 );
+    bench_persist( 10000, 64 );
+    bench_persist( 10000, 1 );
+#endif
+    bench_request( 8 );
+    bench_request( 100 );
+    bench_commit( 200 );
+    bench_concurrent( max_threads );
+    bench_parallel( 100000, max_threads );
+    bench_deferred( 16 );
+    bench_budget();
+    bench_new_return( "heap", 0 );
+    bench_new_return( "arena", 1 );
+    return 0;
+}
@@ -1,17 +1,97 @@
+// too late for feature macros when included by cexitstack.h in CEXITSTACK_HEADER_ONLY mode
+#if defined(__linux__) && !defined(_DEFAULT_SOURCE) && !defined(CEXITSTACK_H)
+#define _DEFAULT_SOURCE
+#endif
+#define CEXITSTACK_C
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 #include "cexitstack.h"
+#include "cexitstack_stats.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CEXITSTACK_NOINLINE __attribute__(( noinline ))
+#define CEXITSTACK_COLD __attribute__(( cold, noinline ))
+#define CEXITSTACK_UNLIKELY(x) __builtin_expect( !!(x), 0 )
+#elif defined(_MSC_VER)
+#define CEXITSTACK_NOINLINE __declspec( noinline )
+#define CEXITSTACK_COLD __declspec( noinline )
+#define CEXITSTACK_UNLIKELY(x) (x)
+#else
+#define CEXITSTACK_NOINLINE
+#define CEXITSTACK_COLD
+#define CEXITSTACK_UNLIKELY(x) (x)
+#endif
+
+// In CEXITSTACK_HEADER_ONLY mode the state below is the cexitstack library's, not a copy per file
+#ifdef CEXITSTACK_HEADER_ONLY
+#define CEXITSTACK_STATE extern
+#else
+#define CEXITSTACK_STATE
+#endif
+
+// Per-thread cache of item arrays (by power-of-two capacity class) and stack headers.
+// Cached blocks are plain malloc blocks, so a block can be freed or cached by any thread.
+typedef struct _cexitstack_arena
+{
+    unsigned int enabled;
+    unsigned int counts[CEXITSTACK_ARENA_CLASSES];
+    void *blocks[CEXITSTACK_ARENA_CLASSES];
+    unsigned int header_count;
+    void *headers;
+    unsigned long long hits;
+    unsigned long long misses;
+} cexitstack_arena;
+
+CEXITSTACK_STATE _Thread_local cexitstack_arena cexitstack_thread_arena;
+
+// called instead of free() for runs of cexitstack_func_free items when set
+CEXITSTACK_STATE cexitstack_batch_free_func *cexitstack_batch_free_hook;
+
+// Context used by cexitstack_defer and the scope functions: the one switched in with
+// cexitstack_context_switch, or the thread's own one while that is NULL.
+// A context's scope is the index + 1 of its innermost scope marker, 0 outside any scope.
+CEXITSTACK_STATE _Thread_local cexitstack_context cexitstack_thread_default_context;
+CEXITSTACK_STATE _Thread_local cexitstack_context *cexitstack_thread_context;
 
 inline static int cexitstack_expand( cexitstack *stack, unsigned int added_capacity );
+static int cexitstack_init_items( cexitstack *stack, unsigned int initial_length );
+static int cexitstack_push_grow( cexitstack *stack, void *object, unsigned int condition, cexitstack_func *func );
+static unsigned int cexitstack_growth_increment( const cexitstack *stack );
+static void cexitstack_shrink( cexitstack *stack );
+static void cexitstack_unwind( cexitstack *stack, unsigned int mark, unsigned int condition );
+static void cexitstack_unwind_items( cexitstack *stack, unsigned int mark, unsigned int condition );
+static void cexitstack_unwind_free( cexitstack *stack, unsigned int mark, unsigned int condition, void *object );
+static void cexitstack_batch_free( void **objects, unsigned int count );
+static void cexitstack_unwind_close( cexitstack *stack, unsigned int mark, unsigned int condition, int fd );
+static void cexitstack_close_fds( const int *fds, unsigned int count );
+static unsigned long long cexitstack_now( void );
+static cexitstack_cost *cexitstack_costs_find( cexitstack_costs *costs, cexitstack_func *func, int add );
+static unsigned int cexitstack_arena_class( unsigned int capacity );
+static cexitstack_item *cexitstack_items_alloc( unsigned int *capacity );
+static void cexitstack_items_release( cexitstack_item *items, unsigned int capacity );
+static cexitstack *cexitstack_header_alloc( void );
+static void cexitstack_header_release( cexitstack *stack );
 
 inline cexitstack *
-cexitstack_new( unsigned int initial_length )
+( cexitstack_new )( unsigned int initial_length )
 {
-    cexitstack *stack = calloc( 1, sizeof( cexitstack ) );
+    cexitstack *stack = cexitstack_header_alloc();
     if (!stack) return NULL;
-    if (!cexitstack_init( stack, initial_length )) {
-        free( stack );
+    if (!( cexitstack_init )( stack, initial_length )) {
+        cexitstack_header_release( stack );
         return NULL;
     }
     stack->stack_allocated = 1;
@@ -19,69 +99,434 @@ cexitstack_new( unsigned int initial_length )
 }
 
 inline int
-cexitstack_init( cexitstack *stack, unsigned int initial_length )
+( cexitstack_init )( cexitstack *stack, unsigned int initial_length )
+{
+    if (!stack || !cexitstack_init_items( stack, initial_length )) return 0;
+    CEXITSTACK_DEBUG_CREATED( stack );
+    return 1;
+}
+
+inline int
+( cexitstack_init_inline )( cexitstack *stack, cexitstack_item *items, unsigned int capacity )
 {
     if (!stack) return 0;
+    if (!items || !capacity) return ( cexitstack_init )( stack, 0 );
+    memset( stack, 0, sizeof( cexitstack ) );
+    stack->capacity = capacity;
+    stack->growth = CEXITSTACK_DEFAULT_GROWTH;
+    stack->items_inline = 1;
+    stack->items = items;
+    CEXITSTACK_DEBUG_CREATED( stack );
+    return 1;
+}
+
+// cexitstack_init without registering the stack, for the contexts' stacks
+static int
+cexitstack_init_items( cexitstack *stack, unsigned int initial_length )
+{
     memset( stack, 0, sizeof( cexitstack ) );
     stack->capacity = initial_length ? initial_length : CEXITSTACK_DEFAULT_INITIAL_CAPACITY;
-    stack->items = calloc( stack->capacity, sizeof( cexitstack_item ) );
-    if (!stack->items) return 0;
+    stack->growth = CEXITSTACK_DEFAULT_GROWTH;
+    stack->items = cexitstack_items_alloc( &stack->capacity );
+    if (!stack->items) {
+        stack->capacity = 0;
+        return 0;
+    }
     return 1;
 }
 
 inline int
 cexitstack_return( cexitstack *stack, int return_val, unsigned int condition )
 {
-    if (stack->items && stack->length > 0) {
-        int i = stack->length;
-        while (i-- > 0) {
-            cexitstack_item *item = stack->items + i;
-            if (item->condition == CEXITSTACK_CONDITION_ALWAYS || condition & item->condition)
-                ( *item->func )( item->object );
-        }
-    }
+    if (stack->items && ( stack->length || stack->rollback_length ))
+        cexitstack_unwind( stack, 0, condition );
     cexitstack_free( stack );
     return return_val;
 }
 
+// like cexitstack_return, but keeps the (emptied) stack for reuse
+inline int
+cexitstack_reset( cexitstack *stack, int return_val, unsigned int condition )
+{
+    if (!stack->items) return return_val;
+    cexitstack_unwind( stack, 0, condition );
+    if (stack->shrink_capacity && stack->capacity > stack->shrink_capacity && !stack->items_inline)
+        cexitstack_shrink( stack );
+    return return_val;
+}
+
+inline unsigned int
+cexitstack_mark( const cexitstack *stack )
+{
+    return stack->length;
+}
+
+inline int
+cexitstack_unwind_to( cexitstack *stack, unsigned int mark, unsigned int condition )
+{
+    if (!stack->items || mark > stack->length) return 0;
+    cexitstack_unwind( stack, mark, condition );
+    return 1;
+}
+
+// Like cexitstack_unwind_to, but stops once budget is used up and returns 0; the items not run yet
+// stay on the stack, so a later call (or e.g. cexitstack_return_deferred) picks up where this one
+// stopped. Returns 1 when everything above mark has been unwound, -1 (without running anything)
+// when mark is above the top of the stack. Skipped items don't count; a NULL budget has no limits.
+// A call that stops before running anything means the top item alone is estimated to take longer
+// than the budget allows, so retrying with the same budget won't help; offload the rest instead.
+inline int
+cexitstack_unwind_budget( cexitstack *stack, unsigned int mark, unsigned int condition, const cexitstack_budget *budget )
+{
+    if (!stack->items || mark > stack->length) return -1;
+    cexitstack_budget unlimited = { 0 };
+    if (!budget) budget = &unlimited;
+    int timed = budget->max_ns || budget->costs;
+    unsigned long long start = timed ? cexitstack_now() : 0, now = start;
+    unsigned int executed = 0;
+    for (;;) {
+        cexitstack_item item;
+        cexitstack_args args;
+        int has_args = 0, rollback = 0;
+        if (stack->rollback_length && stack->rollback[stack->rollback_length - 1].position >= mark
+            && stack->rollback[stack->rollback_length - 1].position >= stack->length) {
+            const cexitstack_rollback_item *top = stack->rollback + stack->rollback_length - 1;
+            item = ( cexitstack_item ){ .object = top->object, .condition = top->condition, .func = top->func };
+            rollback = 1;
+        }
+        else if (stack->length > mark) {
+            item = stack->items[stack->length - 1];
+            has_args = ( item.condition & CEXITSTACK_CONDITION_ARGS ) != 0;
+        }
+        else {
+            return 1;
+        }
+        int matches = CEXITSTACK_CONDITION_MATCHES( item.condition, condition );
+        if (matches) {
+            if (budget->max_items && executed == budget->max_items) return 0;
+            if (budget->max_ns) {
+                unsigned long long elapsed = now - start;
+                if (elapsed >= budget->max_ns) return 0;
+                if (budget->costs && cexitstack_costs_estimate( budget->costs, item.func ) > budget->max_ns - elapsed) return 0;
+            }
+        }
+        // popped before running, so the cleanup may push onto the stack itself
+        if (rollback) stack->rollback_length--;
+        else stack->length -= has_args ? 2 : 1;
+        CEXITSTACK_STATS_UNWOUND( item.condition, matches );
+        if (!matches) continue;
+        if (has_args) memcpy( &args, stack->items + stack->length, sizeof( cexitstack_args ) );
+        CEXITSTACK_STATS_TIMER( called );
+        cexitstack_item_run( &item, has_args ? &args : NULL );
+        CEXITSTACK_STATS_CALLED( item.func, 1, called );
+        executed++;
+        if (timed) {
+            unsigned long long before = now;
+            now = cexitstack_now();
+            cexitstack_cost *cost = budget->costs ? cexitstack_costs_find( budget->costs, item.func, 1 ) : NULL;
+            if (cost) {
+                unsigned long long sample = now - before;
+                if (!cost->calls++) cost->estimate_ns = sample;
+                else if (sample >= cost->estimate_ns) cost->estimate_ns += ( sample - cost->estimate_ns ) >> CEXITSTACK_COSTS_EWMA_SHIFT;
+                else cost->estimate_ns -= ( cost->estimate_ns - sample ) >> CEXITSTACK_COSTS_EWMA_SHIFT;
+            }
+        }
+    }
+}
+
+// estimated cost of one call of func in ns, 0 when costs hasn't seen it yet
+inline unsigned long long
+cexitstack_costs_estimate( const cexitstack_costs *costs, cexitstack_func *func )
+{
+    const cexitstack_cost *cost = cexitstack_costs_find( (cexitstack_costs *)costs, func, 0 );
+    return cost ? cost->estimate_ns : 0;
+}
+
+// A stack without items has no capacity either, so the capacity check alone sends both the full and
+// the uninitialised stack to cexitstack_push_grow.
 inline int
 cexitstack_push_full( cexitstack *stack, void *object, unsigned int condition, cexitstack_func *func )
 {
-    if (!stack->items) return 0;
-    if (stack->length == stack->capacity)
-        if (!cexitstack_expand( stack, 0 ))
-            return 0;
-    cexitstack_item *new_item = &stack->items[stack->length];
-    stack->items[stack->length] = ( cexitstack_item ){ .object = object, .condition = condition, .func = func };
-    stack->length++;
+    if (CEXITSTACK_UNLIKELY( stack->length == stack->capacity ))
+        return cexitstack_push_grow( stack, object, condition, func );
+    cexitstack_item *item = &stack->items[stack->length++];
+    item->object = object;
+    item->condition = condition;
+    item->func = func;
+    CEXITSTACK_STATS_PUSH( 1, stack->length );
+    CEXITSTACK_DEBUG_PUSHED( stack, stack->length - 1 );
     return 1;
 }
 
 inline int
 cexitstack_push_struct( cexitstack *stack, cexitstack_item *item )
 {
-    if (!stack->items || !item) return 0;
-    if (stack->length == stack->capacity)
-        if (!cexitstack_expand( stack, 0 ))
+    if (!item) return 0;
+    if (CEXITSTACK_UNLIKELY( stack->length == stack->capacity ))
+        return cexitstack_push_grow( stack, item->object, item->condition, item->func );
+    stack->items[stack->length++] = *item;
+    CEXITSTACK_STATS_PUSH( 1, stack->length );
+    CEXITSTACK_DEBUG_PUSHED( stack, stack->length - 1 );
+    return 1;
+}
+
+// kept out of line so that only the capacity check and the store are inlined into callers
+CEXITSTACK_COLD static int
+cexitstack_push_grow( cexitstack *stack, void *object, unsigned int condition, cexitstack_func *func )
+{
+    if (!cexitstack_expand( stack, 0 )) return 0;
+    stack->items[stack->length++] = ( cexitstack_item ){ .object = object, .condition = condition, .func = func };
+    CEXITSTACK_STATS_PUSH( 1, stack->length );
+    CEXITSTACK_DEBUG_PUSHED( stack, stack->length - 1 );
+    return 1;
+}
+
+// pushes the args into one slot and an item calling func( args ) above it
+inline int
+cexitstack_push_args( cexitstack *stack, const cexitstack_args *args, unsigned int condition, cexitstack_args_func *func )
+{
+    if (!stack->items || !args) return 0;
+    unsigned int room = stack->capacity - stack->length;
+    if (room < 2) {
+        unsigned int added_capacity = cexitstack_growth_increment( stack );
+        if (added_capacity < 2 - room)
+            added_capacity = 2 - room;
+        if (!cexitstack_expand( stack, added_capacity ))
+            return 0;
+    }
+    memcpy( stack->items + stack->length, args, sizeof( cexitstack_args ) );
+    stack->items[stack->length + 1] = ( cexitstack_item ){ .object = NULL, .condition = condition | CEXITSTACK_CONDITION_ARGS,
+                                                           .func = (cexitstack_func *)func };
+    stack->length += 2;
+    CEXITSTACK_STATS_PUSH( 1, stack->length );
+    CEXITSTACK_DEBUG_PUSHED( stack, stack->length - 1 );
+    return 1;
+}
+
+inline int
+cexitstack_push_free( cexitstack *stack, void *object, unsigned int condition )
+{
+    return cexitstack_push_full( stack, object, condition | CEXITSTACK_CONDITION_KIND( CEXITSTACK_KIND_FREE ), &cexitstack_func_free );
+}
+
+// the fd is stored in the object pointer itself
+inline int
+cexitstack_push_fd( cexitstack *stack, int fd, unsigned int condition )
+{
+    return cexitstack_push_full( stack, (void *)(intptr_t)fd, condition | CEXITSTACK_CONDITION_KIND( CEXITSTACK_KIND_CLOSE ), &cexitstack_func_close );
+}
+
+inline int
+cexitstack_push_file( cexitstack *stack, FILE *file, unsigned int condition )
+{
+    return cexitstack_push_full( stack, file, condition | CEXITSTACK_CONDITION_KIND( CEXITSTACK_KIND_FCLOSE ), &cexitstack_func_fclose );
+}
+
+#ifndef _WIN32
+inline int
+cexitstack_push_mapping( cexitstack *stack, void *address, size_t length, unsigned int condition )
+{
+    return cexitstack_push_args( stack, CEXITSTACK_ARGS( { .pointer = address }, { .size = length } ),
+                                 condition | CEXITSTACK_CONDITION_KIND( CEXITSTACK_KIND_MUNMAP ), &cexitstack_args_munmap );
+}
+#endif
+
+// Pushes a cleanup that only runs on an error unwind (condition must not be ALWAYS) into the stack's
+// rollback segment. It unwinds in LIFO order with the other items, but cexitstack_commit drops the
+// whole segment in O(1), so a later unwind never walks it.
+inline int
+cexitstack_push_rollback( cexitstack *stack, void *object, unsigned int condition, cexitstack_func *func )
+{
+    if (!stack->items || condition & CEXITSTACK_CONDITION_ARGS) return 0;
+    if (!( condition & ~CEXITSTACK_CONDITION_FLAGS )) return cexitstack_push_full( stack, object, condition, func );
+    if (stack->rollback_length == stack->rollback_capacity) {
+        unsigned int new_capacity = stack->rollback_capacity ? stack->rollback_capacity * 2 : CEXITSTACK_ROLLBACK_INITIAL_CAPACITY;
+        if (new_capacity <= stack->rollback_capacity) return 0;
+        cexitstack_rollback_item *new_rollback = realloc( stack->rollback, sizeof( cexitstack_rollback_item ) * new_capacity );
+        if (!new_rollback) return 0;
+        CEXITSTACK_STATS_EXPAND( sizeof( cexitstack_rollback_item ) * stack->rollback_length );
+        stack->rollback = new_rollback;
+        stack->rollback_capacity = new_capacity;
+    }
+    stack->rollback[stack->rollback_length++] = ( cexitstack_rollback_item ){ .object = object, .func = func,
+        .condition = condition, .position = stack->length };
+    CEXITSTACK_STATS_PUSH( 1, stack->length + stack->rollback_length );
+    CEXITSTACK_DEBUG_ROLLBACK_PUSHED( stack, stack->rollback_length - 1 );
+    return 1;
+}
+
+// the operation succeeded: forget every rollback item without running it
+inline void
+cexitstack_commit( cexitstack *stack )
+{
+    stack->rollback_length = 0;
+}
+
+inline int
+cexitstack_push_many( cexitstack *stack, void *const *objects, unsigned int count, unsigned int condition, cexitstack_func *func )
+{
+    if (!stack->items || ( !objects && count )) return 0;
+    if (count > UINT_MAX - stack->length) return 0;
+    unsigned int needed = stack->length + count;
+    if (needed > stack->capacity) {
+        unsigned int added_capacity = cexitstack_growth_increment( stack );
+        if (added_capacity < needed - stack->capacity)
+            added_capacity = needed - stack->capacity;
+        if (!cexitstack_expand( stack, added_capacity ))
             return 0;
-    stack->items[stack->length] = *item;
-    stack->length++;
+    }
+    cexitstack_item *items = stack->items + stack->length;
+    for (unsigned int i = 0; i < count; i++)
+        items[i] = ( cexitstack_item ){ .object = objects[i], .condition = condition, .func = func };
+    stack->length = needed;
+    CEXITSTACK_STATS_PUSH( count, needed );
+#ifdef CEXITSTACK_DEBUG
+    for (unsigned int i = needed - count; i < needed; i++)
+        CEXITSTACK_DEBUG_PUSHED( stack, i );
+#endif
     return 1;
 }
 
+// only the library defines these, so that unwinding recognises them by address in any build
+#ifndef CEXITSTACK_HEADER_ONLY
 inline void
 cexitstack_func_free( void *object )
 {
     if (object) free( object );
 }
 
+inline void
+cexitstack_func_close( void *fd )
+{
+#ifdef _WIN32
+    _close( (int)(intptr_t)fd );
+#else
+    close( (int)(intptr_t)fd );
+#endif
+}
+
+inline void
+cexitstack_func_fclose( void *file )
+{
+    if (file) fclose( file );
+}
+
+#ifndef _WIN32
+inline void
+cexitstack_args_munmap( cexitstack_args *args )
+{
+    munmap( args->arg[0].pointer, args->arg[1].size );
+}
+#endif
+#endif
+
+// runs an item by its kind; items of CEXITSTACK_KIND_FUNC (or unknown kinds) go through func.
+// args is the payload of an args item, NULL otherwise
+inline void
+cexitstack_item_run( const cexitstack_item *item, cexitstack_args *args )
+{
+    switch (CEXITSTACK_ITEM_KIND( item->condition )) {
+    case CEXITSTACK_KIND_FREE:
+        free( item->object );
+        return;
+    case CEXITSTACK_KIND_CLOSE:
+        cexitstack_func_close( item->object );
+        return;
+    case CEXITSTACK_KIND_FCLOSE:
+        cexitstack_func_fclose( item->object );
+        return;
+#ifndef _WIN32
+    case CEXITSTACK_KIND_MUNMAP:
+        if (args) {
+            cexitstack_args_munmap( args );
+            return;
+        }
+        break;
+#endif
+    }
+    if (args) ( *(cexitstack_args_func *)item->func )( args );
+    else ( *item->func )( item->object );
+}
+
+inline int
+cexitstack_reserve( cexitstack *stack, unsigned int capacity )
+{
+    if (!stack || !stack->items) return 0;
+    if (capacity <= stack->capacity) return 1;
+    return cexitstack_expand( stack, capacity - stack->capacity );
+}
+
+inline void
+cexitstack_set_growth( cexitstack *stack, unsigned int growth )
+{
+    if (stack) stack->growth = growth;
+}
+
+static unsigned int
+cexitstack_growth_increment( const cexitstack *stack )
+{
+    return stack->growth == CEXITSTACK_GROWTH_GEOMETRIC ? stack->capacity : stack->growth;
+}
+
+inline void
+cexitstack_set_shrink( cexitstack *stack, unsigned int shrink_capacity )
+{
+    if (stack) stack->shrink_capacity = shrink_capacity;
+}
+
+// replaces the heap item array of an empty stack by one of shrink_capacity items; keeps the old one on failure
+static void
+cexitstack_shrink( cexitstack *stack )
+{
+    unsigned int capacity = stack->shrink_capacity;
+    cexitstack_item *items;
+    if (cexitstack_thread_arena.enabled) {
+        // the arena rounds shrink_capacity up to its class, which an array of that class already has
+        unsigned int size_class = cexitstack_arena_class( capacity );
+        if (size_class < CEXITSTACK_ARENA_CLASSES && stack->capacity <= (unsigned int)CEXITSTACK_ARENA_MIN_CAPACITY << size_class)
+            return;
+        items = cexitstack_items_alloc( &capacity );
+        if (!items) return;
+        cexitstack_items_release( stack->items, stack->capacity );
+    }
+    else {
+        items = realloc( stack->items, sizeof( cexitstack_item ) * capacity );
+        if (!items) return;
+    }
+    stack->items = items;
+    stack->capacity = capacity;
+}
+
+// added_capacity == 0 grows by the stack's growth policy: geometric (doubling) or a fixed linear increment
 inline static int
 cexitstack_expand( cexitstack *stack, unsigned int added_capacity )
 {
     if (!stack->items || !stack->capacity) return 0;
-    unsigned int new_capacity = stack->capacity + ( added_capacity ? added_capacity : CEXITSTACK_DEFAULT_CAPACITY_INCREMENT );
-    cexitstack_item *new_items = realloc( stack->items, sizeof( cexitstack_item ) * new_capacity );
-    if (!new_items) return 0;
+    if (!added_capacity)
+        added_capacity = cexitstack_growth_increment( stack );
+    if (added_capacity > UINT_MAX - stack->capacity) return 0;
+    unsigned int new_capacity = stack->capacity + added_capacity;
+    // only where size_t is as narrow as unsigned int can the byte count wrap
+    size_t new_size = sizeof( cexitstack_item ) * (size_t)new_capacity;
+    if (new_size / sizeof( cexitstack_item ) != new_capacity) return 0;
+    cexitstack_item *new_items;
+    if (stack->items_inline) {
+        new_items = malloc( new_size );
+        if (!new_items) return 0;
+        memcpy( new_items, stack->items, sizeof( cexitstack_item ) * stack->length );
+        stack->items_inline = 0;
+    }
+    else if (cexitstack_thread_arena.enabled) {
+        new_items = cexitstack_items_alloc( &new_capacity );
+        if (!new_items) return 0;
+        memcpy( new_items, stack->items, sizeof( cexitstack_item ) * stack->length );
+        cexitstack_items_release( stack->items, stack->capacity );
+    }
+    else {
+        new_items = realloc( stack->items, new_size );
+        if (!new_items) return 0;
+    }
+    CEXITSTACK_STATS_EXPAND( sizeof( cexitstack_item ) * stack->length );
     stack->items = new_items;
     stack->capacity = new_capacity;
     return 1;
@@ -91,9 +536,422 @@ inline void
 cexitstack_free( cexitstack *stack )
 {
     if (stack) {
-        if (stack->items)
-            free( stack->items );
+        CEXITSTACK_DEBUG_RELEASED( stack );
+        if (stack->items && !stack->items_inline)
+            cexitstack_items_release( stack->items, stack->capacity );
+        free( stack->rollback );
         if (stack->stack_allocated)
-            free( stack );
+            cexitstack_header_release( stack );
+    }
+}
+
+inline cexitstack *
+cexitstack_thread( void )
+{
+    cexitstack *stack = &cexitstack_context_current()->stack;
+    if (!stack->items && !cexitstack_init_items( stack, 0 )) return NULL;
+    return stack;
+}
+
+inline int
+cexitstack_defer( void *object, unsigned int condition, cexitstack_func *func )
+{
+    cexitstack *stack = cexitstack_thread();
+    if (!stack) return 0;
+    return cexitstack_push_full( stack, object, condition, func );
+}
+
+// a scope marker is an item without func, its object holds the enclosing scope
+inline int
+cexitstack_scope_begin( void )
+{
+    cexitstack_context *context = cexitstack_context_current();
+    cexitstack *stack = cexitstack_thread();
+    if (!stack) return 0;
+    if (!cexitstack_push_full( stack, (void *)(uintptr_t)context->scope, CEXITSTACK_CONDITION_ALWAYS, NULL ))
+        return 0;
+    context->scope = stack->length;
+    return 1;
+}
+
+inline int
+cexitstack_scope_end( unsigned int condition )
+{
+    cexitstack_context *context = cexitstack_context_current();
+    cexitstack *stack = &context->stack;
+    unsigned int scope = context->scope;
+    if (!scope) return 0;
+    cexitstack_unwind( stack, scope, condition );
+    context->scope = (unsigned int)(uintptr_t)stack->items[scope - 1].object;
+    stack->length = scope - 1;
+    return 1;
+}
+
+// releases the current context's item array without running anything
+inline void
+cexitstack_thread_free( void )
+{
+    cexitstack_context *context = cexitstack_context_current();
+    if (context->stack.items)
+        cexitstack_items_release( context->stack.items, context->stack.capacity );
+    free( context->stack.rollback );
+    memset( context, 0, sizeof( cexitstack_context ) );
+}
+
+// items are only allocated on the first defer, so a context per task costs nothing until it's used
+inline void
+cexitstack_context_init( cexitstack_context *context )
+{
+    memset( context, 0, sizeof( cexitstack_context ) );
+}
+
+// makes context the calling thread's current context (NULL for the thread's own one), returns the
+// previous one for switching back; a task's context may be switched in on a different thread each time
+inline cexitstack_context *
+cexitstack_context_switch( cexitstack_context *context )
+{
+    cexitstack_context *previous = cexitstack_thread_context;
+    cexitstack_thread_context = context;
+    return previous;
+}
+
+inline cexitstack_context *
+cexitstack_context_current( void )
+{
+    cexitstack_context *context = cexitstack_thread_context;
+    return context ? context : &cexitstack_thread_default_context;
+}
+
+// unwinds all items of a completed or cancelled task, open scopes included, and releases its storage
+inline int
+cexitstack_context_return( cexitstack_context *context, int return_val, unsigned int condition )
+{
+    cexitstack *stack = &context->stack;
+    if (stack->items) {
+        while (context->scope) {
+            unsigned int scope = context->scope;
+            cexitstack_unwind( stack, scope, condition );
+            context->scope = (unsigned int)(uintptr_t)stack->items[scope - 1].object;
+            stack->length = scope - 1;
+        }
+        cexitstack_unwind( stack, 0, condition );
+        cexitstack_items_release( stack->items, stack->capacity );
+        free( stack->rollback );
+    }
+    memset( context, 0, sizeof( cexitstack_context ) );
+    return return_val;
+}
+
+// A rollback item runs after the items pushed above its position and before the ones below it.
+// Rollback items at position mark count as above the mark.
+static void
+cexitstack_unwind( cexitstack *stack, unsigned int mark, unsigned int condition )
+{
+    while (stack->rollback_length && stack->rollback[stack->rollback_length - 1].position >= mark) {
+        unsigned int position = stack->rollback[stack->rollback_length - 1].position;
+        if (stack->length > position) {
+            cexitstack_unwind_items( stack, position, condition );
+            continue;
+        }
+        cexitstack_rollback_item rollback = stack->rollback[--stack->rollback_length];
+        cexitstack_item item = { .object = rollback.object, .condition = rollback.condition, .func = rollback.func };
+        if (!CEXITSTACK_CONDITION_MATCHES( item.condition, condition )) {
+            CEXITSTACK_STATS_UNWOUND( item.condition, 0 );
+            continue;
+        }
+        CEXITSTACK_STATS_UNWOUND( item.condition, 1 );
+        CEXITSTACK_STATS_TIMER( start );
+        cexitstack_item_run( &item, NULL );
+        CEXITSTACK_STATS_CALLED( item.func, 1, start );
+    }
+    cexitstack_unwind_items( stack, mark, condition );
+}
+
+// pops and runs items above mark one at a time, so callbacks may push onto (and grow) the stack themselves
+static void
+cexitstack_unwind_items( cexitstack *stack, unsigned int mark, unsigned int condition )
+{
+    while (stack->length > mark) {
+        cexitstack_item item = stack->items[--stack->length];
+        if (!CEXITSTACK_CONDITION_MATCHES( item.condition, condition )) {
+            if (item.condition & CEXITSTACK_CONDITION_ARGS)
+                stack->length--;
+            CEXITSTACK_STATS_UNWOUND( item.condition, 0 );
+            continue;
+        }
+        CEXITSTACK_STATS_UNWOUND( item.condition, 1 );
+        if (item.condition & CEXITSTACK_CONDITION_ARGS) {
+            cexitstack_args args;
+            memcpy( &args, stack->items + --stack->length, sizeof( cexitstack_args ) );
+            CEXITSTACK_STATS_TIMER( start );
+            cexitstack_item_run( &item, &args );
+            CEXITSTACK_STATS_CALLED( item.func, 1, start );
+        }
+        else if (item.func == &cexitstack_func_free) {
+            cexitstack_unwind_free( stack, mark, condition, item.object );
+        }
+        else if (CEXITSTACK_ITEM_KIND( item.condition ) == CEXITSTACK_KIND_CLOSE) {
+            cexitstack_unwind_close( stack, mark, condition, (int)(intptr_t)item.object );
+        }
+        else if (item.condition & CEXITSTACK_CONDITION_KIND_MASK) {
+            CEXITSTACK_STATS_TIMER( start );
+            cexitstack_item_run( &item, NULL );
+            CEXITSTACK_STATS_CALLED( item.func, 1, start );
+        }
+        else {
+            CEXITSTACK_STATS_TIMER( start );
+            ( *item.func )( item.object );
+            CEXITSTACK_STATS_CALLED( item.func, 1, start );
+        }
+    }
+}
+
+// pops the run of cexitstack_func_free items (non-matching items in between are skipped as usual)
+// below an already popped one, and frees their objects in batches
+static void
+cexitstack_unwind_free( cexitstack *stack, unsigned int mark, unsigned int condition, void *object )
+{
+    void *objects[CEXITSTACK_BATCH_FREE_MAX];
+    unsigned int count = 0;
+    if (object) objects[count++] = object;
+    while (stack->length > mark) {
+        const cexitstack_item *item = stack->items + stack->length - 1;
+        if (CEXITSTACK_CONDITION_MATCHES( item->condition, condition )) {
+            if (item->func != &cexitstack_func_free || item->condition & CEXITSTACK_CONDITION_ARGS) break;
+            CEXITSTACK_STATS_UNWOUND( item->condition, 1 );
+            if (item->object) {
+                objects[count++] = item->object;
+                if (count == CEXITSTACK_BATCH_FREE_MAX) {
+                    cexitstack_batch_free( objects, count );
+                    count = 0;
+                }
+            }
+        }
+        else {
+            CEXITSTACK_STATS_UNWOUND( item->condition, 0 );
+            if (item->condition & CEXITSTACK_CONDITION_ARGS)
+                stack->length--;
+        }
+        stack->length--;
+    }
+    if (count) cexitstack_batch_free( objects, count );
+}
+
+static void
+cexitstack_batch_free( void **objects, unsigned int count )
+{
+    CEXITSTACK_STATS_TIMER( start );
+    if (cexitstack_batch_free_hook) {
+        ( *cexitstack_batch_free_hook )( objects, count );
+    }
+    else {
+        for (unsigned int i = 0; i < count; i++)
+            free( objects[i] );
+    }
+    CEXITSTACK_STATS_CALLED( &cexitstack_func_free, count, start );
+}
+
+// like cexitstack_unwind_free, for the run of fd items below an already popped one
+static void
+cexitstack_unwind_close( cexitstack *stack, unsigned int mark, unsigned int condition, int fd )
+{
+    int fds[CEXITSTACK_BATCH_FREE_MAX];
+    unsigned int count = 0, closed = 1;
+    fds[count++] = fd;
+    CEXITSTACK_STATS_TIMER( start );
+    while (stack->length > mark) {
+        const cexitstack_item *item = stack->items + stack->length - 1;
+        if (CEXITSTACK_CONDITION_MATCHES( item->condition, condition )) {
+            if (CEXITSTACK_ITEM_KIND( item->condition ) != CEXITSTACK_KIND_CLOSE || item->condition & CEXITSTACK_CONDITION_ARGS) break;
+            CEXITSTACK_STATS_UNWOUND( item->condition, 1 );
+            fds[count++] = (int)(intptr_t)item->object;
+            closed++;
+            if (count == CEXITSTACK_BATCH_FREE_MAX) {
+                cexitstack_close_fds( fds, count );
+                count = 0;
+            }
+        }
+        else {
+            CEXITSTACK_STATS_UNWOUND( item->condition, 0 );
+            if (item->condition & CEXITSTACK_CONDITION_ARGS)
+                stack->length--;
+        }
+        stack->length--;
+    }
+    if (count) cexitstack_close_fds( fds, count );
+    CEXITSTACK_STATS_CALLED( &cexitstack_func_close, closed, start );
+}
+
+// fds pushed in ascending order (as they're usually opened) come off the stack descending:
+// each such run of consecutive fds is closed with one close_range where the kernel has it
+static void
+cexitstack_close_fds( const int *fds, unsigned int count )
+{
+    unsigned int i = 0;
+    while (i < count) {
+        unsigned int run = 1;
+        while (i + run < count && fds[i + run] == fds[i] - (int)run)
+            run++;
+#if defined(SYS_close_range) && defined(_DEFAULT_SOURCE)
+        if (run > 1 && fds[i + run - 1] >= 0 && syscall( SYS_close_range, (unsigned int)fds[i + run - 1], (unsigned int)fds[i], 0u ) == 0) {
+            i += run;
+            continue;
+        }
+#endif
+        for (unsigned int k = 0; k < run; k++)
+            cexitstack_func_close( (void *)(intptr_t)fds[i + k] );
+        i += run;
+    }
+}
+
+static unsigned long long
+cexitstack_now( void )
+{
+    struct timespec now;
+    timespec_get( &now, TIME_UTC );
+    return (unsigned long long)now.tv_sec * 1000000000ull + (unsigned long long)now.tv_nsec;
+}
+
+// open addressing on the function pointer; NULL when func isn't there (and can't be added)
+static cexitstack_cost *
+cexitstack_costs_find( cexitstack_costs *costs, cexitstack_func *func, int add )
+{
+    if (!func) return NULL;
+    unsigned int slot = (unsigned int)( ( (uintptr_t)func >> 4 ) % CEXITSTACK_COSTS_MAX_FUNCS );
+    for (unsigned int probe = 0; probe < CEXITSTACK_COSTS_MAX_FUNCS; probe++) {
+        cexitstack_cost *cost = costs->funcs + ( slot + probe ) % CEXITSTACK_COSTS_MAX_FUNCS;
+        if (cost->func == func) return cost;
+        if (!cost->func) {
+            if (!add) return NULL;
+            cost->func = func;
+            return cost;
+        }
+    }
+    return NULL;
+}
+
+inline void
+cexitstack_set_batch_free( cexitstack_batch_free_func *func )
+{
+    cexitstack_batch_free_hook = func;
+}
+
+inline void
+cexitstack_arena_enable( void )
+{
+    cexitstack_thread_arena.enabled = 1;
+}
+
+inline void
+cexitstack_arena_disable( void )
+{
+    cexitstack_arena *arena = &cexitstack_thread_arena;
+    arena->enabled = 0;
+    for (unsigned int i = 0; i < CEXITSTACK_ARENA_CLASSES; i++) {
+        while (arena->blocks[i]) {
+            void *block = arena->blocks[i];
+            arena->blocks[i] = *(void **)block;
+            free( block );
+        }
+        arena->counts[i] = 0;
+    }
+    while (arena->headers) {
+        void *header = arena->headers;
+        arena->headers = *(void **)header;
+        free( header );
+    }
+    arena->header_count = 0;
+}
+
+inline void
+cexitstack_arena_stats_get( cexitstack_arena_stats *stats )
+{
+    if (!stats) return;
+    cexitstack_arena *arena = &cexitstack_thread_arena;
+    memset( stats, 0, sizeof( cexitstack_arena_stats ) );
+    stats->hits = arena->hits;
+    stats->misses = arena->misses;
+    for (unsigned int i = 0; i < CEXITSTACK_ARENA_CLASSES; i++)
+        stats->cached_items += arena->counts[i];
+    stats->cached_headers = arena->header_count;
+}
+
+// index of the smallest arena class holding capacity items, CEXITSTACK_ARENA_CLASSES if none does
+static unsigned int
+cexitstack_arena_class( unsigned int capacity )
+{
+    unsigned int size_class = 0;
+    while (size_class < CEXITSTACK_ARENA_CLASSES && ( (unsigned int)CEXITSTACK_ARENA_MIN_CAPACITY << size_class ) < capacity)
+        size_class++;
+    return size_class;
+}
+
+// item arrays from the heap are zeroed, arrays from the arena are not; *capacity may be rounded up
+static cexitstack_item *
+cexitstack_items_alloc( unsigned int *capacity )
+{
+    cexitstack_arena *arena = &cexitstack_thread_arena;
+    if (!arena->enabled) return calloc( *capacity, sizeof( cexitstack_item ) );
+    unsigned int size_class = cexitstack_arena_class( *capacity );
+    if (size_class == CEXITSTACK_ARENA_CLASSES) {
+        arena->misses++;
+        return malloc( sizeof( cexitstack_item ) * *capacity );
+    }
+    *capacity = CEXITSTACK_ARENA_MIN_CAPACITY << size_class;
+    void *block = arena->blocks[size_class];
+    if (block) {
+        arena->blocks[size_class] = *(void **)block;
+        arena->counts[size_class]--;
+        arena->hits++;
+        return block;
+    }
+    arena->misses++;
+    return malloc( sizeof( cexitstack_item ) * *capacity );
+}
+
+static void
+cexitstack_items_release( cexitstack_item *items, unsigned int capacity )
+{
+    cexitstack_arena *arena = &cexitstack_thread_arena;
+    if (arena->enabled) {
+        unsigned int size_class = cexitstack_arena_class( capacity );
+        if (size_class < CEXITSTACK_ARENA_CLASSES && capacity == (unsigned int)CEXITSTACK_ARENA_MIN_CAPACITY << size_class
+            && arena->counts[size_class] < CEXITSTACK_ARENA_MAX_CACHED) {
+            *(void **)items = arena->blocks[size_class];
+            arena->blocks[size_class] = items;
+            arena->counts[size_class]++;
+            return;
+        }
+    }
+    free( items );
+}
+
+static cexitstack *
+cexitstack_header_alloc( void )
+{
+    cexitstack_arena *arena = &cexitstack_thread_arena;
+    if (!arena->enabled) return calloc( 1, sizeof( cexitstack ) );
+    void *header = arena->headers;
+    if (header) {
+        arena->headers = *(void **)header;
+        arena->header_count--;
+        arena->hits++;
+        return header;
+    }
+    arena->misses++;
+    return malloc( sizeof( cexitstack ) );
+}
+
+// out of line, or inlining cexitstack_free makes GCC warn about freeing stacks that live on the caller's frame
+CEXITSTACK_NOINLINE static void
+cexitstack_header_release( cexitstack *stack )
+{
+    cexitstack_arena *arena = &cexitstack_thread_arena;
+    if (arena->enabled && arena->header_count < CEXITSTACK_ARENA_MAX_CACHED) {
+        *(void **)stack = arena->headers;
+        arena->headers = stack;
+        arena->header_count++;
+        return;
     }
+    free( stack );
 }
\ No newline at end of file
@@ -2,12 +2,61 @@
 #ifndef CEXITSTACK_H
 #define CEXITSTACK_H
 
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// With CEXITSTACK_HEADER_ONLY defined before including this header, the whole implementation is
+// compiled into the including translation unit as static inline functions, so the push fast path
+// can be inlined into callers. cexitstack.c must be next to this header then.
+// The cleanup functions that are recognised by address (CEXITSTACK_SHARED) and the per-thread state
+// aren't copied though: they stay in the cexitstack library, which has to be linked as well, so
+// header-only code and the library modules agree on them.
+#ifdef CEXITSTACK_HEADER_ONLY
+#define CEXITSTACK_API static inline
+#define CEXITSTACK_SHARED extern
+#else
+#define CEXITSTACK_API extern inline
+#define CEXITSTACK_SHARED extern inline
+#endif
+
 #define CEXITSTACK_CONDITION_ALWAYS 0
 #define CEXITSTACK_CONDITION_ERROR 1
+#define CEXITSTACK_CONDITION_INDEPENDENT 0x80000000u
+// set on the item above an inline args payload, see cexitstack_push_args
+#define CEXITSTACK_CONDITION_ARGS 0x40000000u
+// built-in cleanup kind of an item (CEXITSTACK_KIND_*), run without calling through func
+#define CEXITSTACK_CONDITION_KIND_MASK 0x0F000000u
+#define CEXITSTACK_CONDITION_KIND_SHIFT 24
+#define CEXITSTACK_CONDITION_KIND(kind) ( (unsigned int)(kind) << CEXITSTACK_CONDITION_KIND_SHIFT )
+#define CEXITSTACK_CONDITION_FLAGS ( CEXITSTACK_CONDITION_INDEPENDENT | CEXITSTACK_CONDITION_ARGS | CEXITSTACK_CONDITION_KIND_MASK )
+#define CEXITSTACK_ITEM_KIND(condition) ( ( (condition) & CEXITSTACK_CONDITION_KIND_MASK ) >> CEXITSTACK_CONDITION_KIND_SHIFT )
+#define CEXITSTACK_KIND_FUNC 0
+#define CEXITSTACK_KIND_FREE 1
+#define CEXITSTACK_KIND_CLOSE 2
+#define CEXITSTACK_KIND_FCLOSE 3
+#define CEXITSTACK_KIND_MUNMAP 4
 #define CEXITSTACK_DEFAULT_INITIAL_CAPACITY 10
 #define CEXITSTACK_DEFAULT_CAPACITY_INCREMENT 10
+#define CEXITSTACK_GROWTH_GEOMETRIC 0
+#define CEXITSTACK_DEFAULT_GROWTH CEXITSTACK_GROWTH_GEOMETRIC
+#define CEXITSTACK_BATCH_FREE_MAX 64
+#define CEXITSTACK_ARENA_MIN_CAPACITY 8
+#define CEXITSTACK_ARENA_CLASSES 16
+#define CEXITSTACK_ARENA_MAX_CACHED 32
+#define CEXITSTACK_ARGS_MAX 3
+#define CEXITSTACK_ROLLBACK_INITIAL_CAPACITY 16
+#define CEXITSTACK_COSTS_MAX_FUNCS 64
+// new samples weigh 1/2^CEXITSTACK_COSTS_EWMA_SHIFT in a function's cost estimate
+#define CEXITSTACK_COSTS_EWMA_SHIFT 3
+
+// flag bits (CEXITSTACK_CONDITION_FLAGS) are ignored when matching conditions
+#define CEXITSTACK_CONDITION_MATCHES(item_condition, condition)                                  \
+    ( ( (item_condition) & ~CEXITSTACK_CONDITION_FLAGS ) == CEXITSTACK_CONDITION_ALWAYS          \
+      || (condition) & (item_condition) & ~CEXITSTACK_CONDITION_FLAGS )
 
 typedef void cexitstack_func( void * );
+typedef void cexitstack_batch_free_func( void **objects, unsigned int count );
 
 typedef struct _cexitstack_item
 {
@@ -16,28 +65,200 @@ typedef struct _cexitstack_item
     cexitstack_func *func;
 } cexitstack_item;
 
+typedef union _cexitstack_arg
+{
+    void *pointer;
+    uintptr_t word;
+    size_t size;
+    int fd;
+} cexitstack_arg;
+
+// Arguments for cleanups that need more than one pointer, e.g. munmap( addr, len ). They're stored
+// in the item slot below the one holding the function, so no context struct has to be allocated.
+typedef struct _cexitstack_args
+{
+    cexitstack_arg arg[CEXITSTACK_ARGS_MAX];
+} cexitstack_args;
+
+typedef void cexitstack_args_func( cexitstack_args *args );
+
+_Static_assert( sizeof( cexitstack_args ) <= sizeof( cexitstack_item ), "cexitstack_args must fit into an item slot" );
+
+// An item pushed with cexitstack_push_rollback, kept apart from the others so cexitstack_commit can
+// drop all of them at once. position is the stack's length at the time it was pushed.
+typedef struct _cexitstack_rollback_item
+{
+    void *object;
+    cexitstack_func *func;
+    unsigned int condition;
+    unsigned int position;
+} cexitstack_rollback_item;
+
 typedef struct _cexitstack
 {
     unsigned int length;
     unsigned int capacity;
     unsigned int stack_allocated;
+    unsigned int growth;
+    unsigned int items_inline;
+    unsigned int shrink_capacity;
     cexitstack_item *items;
+    unsigned int rollback_length;
+    unsigned int rollback_capacity;
+    cexitstack_rollback_item *rollback;
+    // the stack's entry in the live stack registry, NULL unless built with CEXITSTACK_DEBUG
+    struct _cexitstack_debug_record *debug;
 } cexitstack;
 
-extern inline cexitstack *cexitstack_new( unsigned int initial_length );
-extern inline int cexitstack_init( cexitstack *stack, unsigned int initial_length );
-extern inline int cexitstack_return( cexitstack *stack, int return_val, unsigned int condition );
-extern inline int cexitstack_push_full( cexitstack *stack, void *object, unsigned int condition, cexitstack_func *func );
-extern inline int cexitstack_push_struct( cexitstack *stack, cexitstack_item *item );
-extern inline void cexitstack_free( cexitstack *stack );
-extern inline void cexitstack_func_free( void *object );
-
-#define cexitstack_push(X, Y, ...) _Generic((Y), \
-    cexitstack_item *: cexitstack_push_struct,   \
-    void *: cexitstack_push_full,                \
-    default: cexitstack_push_full                \
+// The state behind cexitstack_defer and the scope functions. Every thread starts out with its own
+// context; a coroutine scheduler can give each task one and switch it in whenever the task runs.
+typedef struct _cexitstack_context
+{
+    cexitstack stack;
+    unsigned int scope;
+} cexitstack_context;
+
+// Running estimates of what the cleanup functions cost, learned by cexitstack_unwind_budget.
+// Zero-initialise one per thread; it holds up to CEXITSTACK_COSTS_MAX_FUNCS functions.
+typedef struct _cexitstack_cost
+{
+    cexitstack_func *func;
+    unsigned long long estimate_ns;
+    unsigned long long calls;
+} cexitstack_cost;
+
+typedef struct _cexitstack_costs
+{
+    cexitstack_cost funcs[CEXITSTACK_COSTS_MAX_FUNCS];
+} cexitstack_costs;
+
+// Limits for cexitstack_unwind_budget, 0 for no limit. It returns 1 when it's done, 0 when it
+// stopped early and -1 for a mark above the top of the stack. With costs set, the unwind also stops
+// before a cleanup whose estimated cost doesn't fit into the time left.
+typedef struct _cexitstack_budget
+{
+    unsigned int max_items;
+    unsigned long long max_ns;
+    cexitstack_costs *costs;
+} cexitstack_budget;
+
+typedef struct _cexitstack_arena_stats
+{
+    unsigned long long hits;
+    unsigned long long misses;
+    unsigned long long cached_items;
+    unsigned long long cached_headers;
+} cexitstack_arena_stats;
+
+CEXITSTACK_API cexitstack *cexitstack_new( unsigned int initial_length );
+CEXITSTACK_API int cexitstack_init( cexitstack *stack, unsigned int initial_length );
+CEXITSTACK_API int cexitstack_init_inline( cexitstack *stack, cexitstack_item *items, unsigned int capacity );
+CEXITSTACK_API int cexitstack_return( cexitstack *stack, int return_val, unsigned int condition );
+CEXITSTACK_API int cexitstack_reset( cexitstack *stack, int return_val, unsigned int condition );
+CEXITSTACK_API unsigned int cexitstack_mark( const cexitstack *stack );
+CEXITSTACK_API int cexitstack_unwind_to( cexitstack *stack, unsigned int mark, unsigned int condition );
+CEXITSTACK_API int cexitstack_unwind_budget( cexitstack *stack, unsigned int mark, unsigned int condition, const cexitstack_budget *budget );
+CEXITSTACK_API unsigned long long cexitstack_costs_estimate( const cexitstack_costs *costs, cexitstack_func *func );
+CEXITSTACK_API int cexitstack_push_full( cexitstack *stack, void *object, unsigned int condition, cexitstack_func *func );
+CEXITSTACK_API int cexitstack_push_struct( cexitstack *stack, cexitstack_item *item );
+CEXITSTACK_API int cexitstack_push_args( cexitstack *stack, const cexitstack_args *args, unsigned int condition, cexitstack_args_func *func );
+CEXITSTACK_API int cexitstack_push_free( cexitstack *stack, void *object, unsigned int condition );
+CEXITSTACK_API int cexitstack_push_fd( cexitstack *stack, int fd, unsigned int condition );
+CEXITSTACK_API int cexitstack_push_file( cexitstack *stack, FILE *file, unsigned int condition );
+#ifndef _WIN32
+CEXITSTACK_API int cexitstack_push_mapping( cexitstack *stack, void *address, size_t length, unsigned int condition );
+#endif
+CEXITSTACK_API int cexitstack_push_rollback( cexitstack *stack, void *object, unsigned int condition, cexitstack_func *func );
+CEXITSTACK_API void cexitstack_commit( cexitstack *stack );
+CEXITSTACK_API int cexitstack_push_many( cexitstack *stack, void *const *objects, unsigned int count, unsigned int condition, cexitstack_func *func );
+CEXITSTACK_API int cexitstack_reserve( cexitstack *stack, unsigned int capacity );
+CEXITSTACK_API void cexitstack_set_growth( cexitstack *stack, unsigned int growth );
+CEXITSTACK_API void cexitstack_set_shrink( cexitstack *stack, unsigned int shrink_capacity );
+CEXITSTACK_API void cexitstack_free( cexitstack *stack );
+CEXITSTACK_SHARED void cexitstack_func_free( void *object );
+CEXITSTACK_SHARED void cexitstack_func_close( void *fd );
+CEXITSTACK_SHARED void cexitstack_func_fclose( void *file );
+#ifndef _WIN32
+CEXITSTACK_SHARED void cexitstack_args_munmap( cexitstack_args *args );
+#endif
+CEXITSTACK_API void cexitstack_item_run( const cexitstack_item *item, cexitstack_args *args );
+CEXITSTACK_API void cexitstack_set_batch_free( cexitstack_batch_free_func *func );
+CEXITSTACK_API cexitstack *cexitstack_thread( void );
+CEXITSTACK_API int cexitstack_defer( void *object, unsigned int condition, cexitstack_func *func );
+CEXITSTACK_API int cexitstack_scope_begin( void );
+CEXITSTACK_API int cexitstack_scope_end( unsigned int condition );
+CEXITSTACK_API void cexitstack_thread_free( void );
+CEXITSTACK_API void cexitstack_context_init( cexitstack_context *context );
+CEXITSTACK_API cexitstack_context *cexitstack_context_switch( cexitstack_context *context );
+CEXITSTACK_API cexitstack_context *cexitstack_context_current( void );
+CEXITSTACK_API int cexitstack_context_return( cexitstack_context *context, int return_val, unsigned int condition );
+CEXITSTACK_API void cexitstack_arena_enable( void );
+CEXITSTACK_API void cexitstack_arena_disable( void );
+CEXITSTACK_API void cexitstack_arena_stats_get( cexitstack_arena_stats *stats );
+
+// With CEXITSTACK_DEBUG (see cexitstack_debug.h), the functions creating a stack are wrapped to
+// record their call site, and cexitstack.c calls the registry hooks. cexitstack.c defines these
+// functions with parenthesized names, so that the wrappers don't apply there.
+#ifdef CEXITSTACK_DEBUG
+extern inline void cexitstack_debug_site( const char *file, int line );
+extern inline void cexitstack_debug_created( cexitstack *stack );
+extern inline void cexitstack_debug_released( cexitstack *stack );
+extern inline void cexitstack_debug_pushed( const cexitstack *stack, unsigned int position );
+extern inline void cexitstack_debug_rollback_pushed( const cexitstack *stack, unsigned int index );
+extern inline _Noreturn void cexitstack_debug_overflow( const char *file, int line, unsigned int capacity );
+
+#define cexitstack_new(initial_length) \
+    ( cexitstack_debug_site( __FILE__, __LINE__ ), cexitstack_new( (initial_length) ) )
+#define cexitstack_init(stack, initial_length) \
+    ( cexitstack_debug_site( __FILE__, __LINE__ ), cexitstack_init( (stack), (initial_length) ) )
+#define cexitstack_init_inline(stack, items, capacity) \
+    ( cexitstack_debug_site( __FILE__, __LINE__ ), cexitstack_init_inline( (stack), (items), (capacity) ) )
+
+#define CEXITSTACK_DEBUG_CREATED(stack) cexitstack_debug_created( (stack) )
+#define CEXITSTACK_DEBUG_RELEASED(stack) cexitstack_debug_released( (stack) )
+#define CEXITSTACK_DEBUG_PUSHED(stack, position) \
+    do { if ((stack)->debug) cexitstack_debug_pushed( (stack), (position) ); } while (0)
+#define CEXITSTACK_DEBUG_ROLLBACK_PUSHED(stack, index) \
+    do { if ((stack)->debug) cexitstack_debug_rollback_pushed( (stack), (index) ); } while (0)
+#define CEXITSTACK_OVERFLOW(capacity) cexitstack_debug_overflow( __FILE__, __LINE__, (capacity) )
+#else
+#define CEXITSTACK_DEBUG_CREATED(stack)
+#define CEXITSTACK_DEBUG_RELEASED(stack)
+#define CEXITSTACK_DEBUG_PUSHED(stack, position)
+#define CEXITSTACK_DEBUG_ROLLBACK_PUSHED(stack, index)
+#define CEXITSTACK_OVERFLOW(capacity) abort()
+#endif
+
+#define cexitstack_push(X, Y, ...) _Generic((Y),     \
+    cexitstack_item *: cexitstack_push_struct,       \
+    cexitstack_args *: cexitstack_push_args,         \
+    const cexitstack_args *: cexitstack_push_args,   \
+    void *: cexitstack_push_full,                    \
+    default: cexitstack_push_full                    \
 ) ((X), (Y), ## __VA_ARGS__);
 
+// CEXITSTACK_ARGS( { .pointer = addr }, { .size = length } ) for cexitstack_push and CEXITSTACK_PUSH_ARGS
+#define CEXITSTACK_ARGS(...) ( &(cexitstack_args){ .arg = { __VA_ARGS__ } } )
+
+// pops the top item of items[0..length) and runs it if it matches condition; returns the new length
+static inline unsigned int
+cexitstack_item_pop( cexitstack_item *items, unsigned int length, unsigned int condition )
+{
+    cexitstack_item *item = items + --length;
+    int has_args = ( item->condition & CEXITSTACK_CONDITION_ARGS ) != 0;
+    if (has_args) length--;
+    if (!CEXITSTACK_CONDITION_MATCHES( item->condition, condition )) return length;
+    cexitstack_args args;
+    if (has_args) memcpy( &args, items + length, sizeof( cexitstack_args ) );
+    if (item->condition & CEXITSTACK_CONDITION_KIND_MASK)
+        cexitstack_item_run( item, has_args ? &args : NULL );
+    else if (has_args)
+        ( *(cexitstack_args_func *)item->func )( &args );
+    else
+        ( *item->func )( item->object );
+    return length;
+}
+
 #define CEXITSTACK(name, n)      \
 struct {                         \
     unsigned int length;         \
@@ -45,17 +266,69 @@ struct {                         \
     cexitstack_item items[(n)];  \
 } (name) = { .capacity=(n) };
 
+#define CEXITSTACK_INLINE(name, n)                            \
+struct {                                                      \
+    cexitstack stack;                                         \
+    cexitstack_item inline_items[(n)];                        \
+} (name);                                                     \
+cexitstack_init_inline( &(name).stack, (name).inline_items, (n) );
+
 #define CEXITSTACK_PUSH(stack, obj, cond, fun) { \
-if ((stack).capacity <= (stack).length) abort(); \
+if ((stack).capacity <= (stack).length) CEXITSTACK_OVERFLOW( (stack).capacity ); \
 (stack).items[(stack).length++] = (cexitstack_item){ .object = (obj), .condition = (cond), .func = (fun) }; }
 
+#define CEXITSTACK_PUSH_FREE(stack, obj, cond) \
+    CEXITSTACK_PUSH( (stack), (obj), (cond) | CEXITSTACK_CONDITION_KIND( CEXITSTACK_KIND_FREE ), &cexitstack_func_free )
+
+#define CEXITSTACK_PUSH_FD(stack, fd, cond) \
+    CEXITSTACK_PUSH( (stack), (void *)(intptr_t)(fd), (cond) | CEXITSTACK_CONDITION_KIND( CEXITSTACK_KIND_CLOSE ), &cexitstack_func_close )
+
+// takes two slots: the args and the item running fun( args ) above them
+#define CEXITSTACK_PUSH_ARGS(stack, args, cond, fun) {                                 \
+if ((stack).capacity - (stack).length < 2) CEXITSTACK_OVERFLOW( (stack).capacity );  \
+memcpy( &(stack).items[(stack).length++], (args), sizeof( cexitstack_args ) );        \
+(stack).items[(stack).length++] = (cexitstack_item){ .object = NULL,                  \
+    .condition = (cond) | CEXITSTACK_CONDITION_ARGS,                                  \
+    .func = (cexitstack_func *)(cexitstack_args_func *)(fun) }; }
+
 #define CEXITSTACK_RETURN(stack, retval, cond) {                                      \
-int avoid_using_this_macro_internal_variable = (stack).length;                        \
-while (avoid_using_this_macro_internal_variable-- > 0) {                              \
-    cexitstack_item *item = (stack).items + avoid_using_this_macro_internal_variable; \
-    if (item->condition == CEXITSTACK_CONDITION_ALWAYS || (cond) & item->condition)   \
-        ( *item->func )( item->object );                                              \
-}                                                                                     \
+unsigned int avoid_using_this_macro_internal_variable = (stack).length;               \
+while (avoid_using_this_macro_internal_variable > 0)                                  \
+    avoid_using_this_macro_internal_variable = cexitstack_item_pop(                   \
+        (stack).items, avoid_using_this_macro_internal_variable, (cond) );            \
+(stack).length = 0;                                                                   \
 return (retval); }
 
+#if defined(__GNUC__) || defined(__clang__)
+typedef struct __attribute__(( may_alias )) _cexitstack_scoped
+{
+    unsigned int length;
+    unsigned int capacity;
+    const unsigned int *condition;
+    cexitstack_item items[];
+} cexitstack_scoped;
+
+static inline void
+cexitstack_scoped_unwind( void *stack )
+{
+    cexitstack_scoped *scoped = (cexitstack_scoped *)stack;
+    while (scoped->length > 0)
+        scoped->length = cexitstack_item_pop( scoped->items, scoped->length, *scoped->condition );
+}
+
+#define CEXITSTACK_SCOPED(name, n, cond_var)                 \
+__attribute__(( cleanup( cexitstack_scoped_unwind ) ))       \
+struct {                                                     \
+    unsigned int length;                                     \
+    unsigned int capacity;                                   \
+    const unsigned int *condition;                           \
+    cexitstack_item items[(n)];                              \
+} (name) = { .capacity=(n), .condition=&(cond_var) };
+#endif
+
+// when cexitstack_stats.h is included first, it includes the implementation once it's complete
+#if defined(CEXITSTACK_HEADER_ONLY) && !defined(CEXITSTACK_STATS_H)
+#include "cexitstack.c"
+#endif
+
 #endif
\ No newline at end of file
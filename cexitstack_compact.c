@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "cexitstack_compact.h"
+
+#if !defined(CEXITSTACK_COMPACT_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define CEXITSTACK_COMPACT_AVX2
+#define CEXITSTACK_COMPACT_SSE2
+#elif defined(__SSE2__) || defined(_M_X64) || ( defined(_M_IX86_FP) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define CEXITSTACK_COMPACT_SSE2
+#endif
+#endif
+#if defined(_MSC_VER) && defined(_M_X64)
+#include <intrin.h>
+#endif
+
+// objects, conditions and func table indices live in three arrays carved from one block
+#define CEXITSTACK_COMPACT_ITEM_SIZE ( sizeof( void * ) + sizeof( unsigned int ) + sizeof( unsigned char ) )
+_Static_assert( CEXITSTACK_COMPACT_MAX_FUNCS <= UCHAR_MAX + 1, "func table indices must fit into an unsigned char" );
+
+static int cexitstack_compact_resize( cexitstack_compact *stack, unsigned int capacity );
+static int cexitstack_compact_func_index( cexitstack_compact *stack, cexitstack_func *func );
+static uint64_t cexitstack_compact_match_mask( const unsigned int *conditions, unsigned int count, unsigned int condition );
+static unsigned int cexitstack_compact_highest_bit( uint64_t mask );
+
+inline cexitstack_compact *
+cexitstack_compact_new( unsigned int initial_length )
+{
+    cexitstack_compact *stack = malloc( sizeof( cexitstack_compact ) );
+    if (!stack) return NULL;
+    if (!cexitstack_compact_init( stack, initial_length )) {
+        free( stack );
+        return NULL;
+    }
+    stack->stack_allocated = 1;
+    return stack;
+}
+
+inline int
+cexitstack_compact_init( cexitstack_compact *stack, unsigned int initial_length )
+{
+    if (!stack) return 0;
+    stack->length = 0;
+    stack->capacity = 0;
+    stack->stack_allocated = 0;
+    stack->func_count = 0;
+    stack->objects = NULL;
+    stack->conditions = NULL;
+    stack->funcs = NULL;
+    return cexitstack_compact_resize( stack, initial_length ? initial_length : CEXITSTACK_DEFAULT_INITIAL_CAPACITY );
+}
+
+inline int
+cexitstack_compact_return( cexitstack_compact *stack, int return_val, unsigned int condition )
+{
+    // items are matched 64 at a time from the top; matching items that share a function
+    // are called in a row with the function looked up once
+    unsigned int end = stack->objects ? stack->length : 0;
+    while (end > 0) {
+        unsigned int begin = end > 64 ? end - 64 : 0;
+        uint64_t mask = cexitstack_compact_match_mask( stack->conditions + begin, end - begin, condition );
+        if (mask == UINT64_MAX >> ( 64 - ( end - begin ) )) {
+            unsigned int i = end;
+            while (i > begin) {
+                unsigned char func_index = stack->funcs[i - 1];
+                cexitstack_func *func = stack->func_table[func_index];
+                do {
+                    i--;
+                    ( *func )( stack->objects[i] );
+                } while (i > begin && stack->funcs[i - 1] == func_index);
+            }
+            mask = 0;
+        }
+        while (mask) {
+            unsigned int bit = cexitstack_compact_highest_bit( mask );
+            unsigned char func_index = stack->funcs[begin + bit];
+            cexitstack_func *func = stack->func_table[func_index];
+            do {
+                ( *func )( stack->objects[begin + bit] );
+                mask &= ~( (uint64_t)1 << bit );
+                if (!mask) break;
+                bit = cexitstack_compact_highest_bit( mask );
+            } while (stack->funcs[begin + bit] == func_index);
+        }
+        end = begin;
+    }
+    cexitstack_compact_free( stack );
+    return return_val;
+}
+
+inline int
+cexitstack_compact_push_full( cexitstack_compact *stack, void *object, unsigned int condition, cexitstack_func *func )
+{
+    if (!stack->objects) return 0;
+    int func_index = cexitstack_compact_func_index( stack, func );
+    if (func_index < 0) return 0;
+    if (stack->length == stack->capacity) {
+        if (stack->capacity > UINT_MAX / 2) return 0;
+        if (!cexitstack_compact_resize( stack, stack->capacity * 2 ))
+            return 0;
+    }
+    stack->objects[stack->length] = object;
+    stack->conditions[stack->length] = condition;
+    stack->funcs[stack->length] = (unsigned char)func_index;
+    stack->length++;
+    return 1;
+}
+
+inline void
+cexitstack_compact_free( cexitstack_compact *stack )
+{
+    if (stack) {
+        if (stack->objects)
+            free( stack->objects );
+        if (stack->stack_allocated)
+            free( stack );
+    }
+}
+
+static int
+cexitstack_compact_resize( cexitstack_compact *stack, unsigned int capacity )
+{
+    size_t size = CEXITSTACK_COMPACT_ITEM_SIZE * (size_t)capacity;
+    if (size / CEXITSTACK_COMPACT_ITEM_SIZE != capacity) return 0;
+    char *block = malloc( size );
+    if (!block) return 0;
+    void **objects = (void **)block;
+    unsigned int *conditions = (unsigned int *)( objects + capacity );
+    unsigned char *funcs = (unsigned char *)( conditions + capacity );
+    if (stack->objects) {
+        memcpy( objects, stack->objects, sizeof( void * ) * stack->length );
+        memcpy( conditions, stack->conditions, sizeof( unsigned int ) * stack->length );
+        memcpy( funcs, stack->funcs, stack->length );
+        free( stack->objects );
+    }
+    stack->objects = objects;
+    stack->conditions = conditions;
+    stack->funcs = funcs;
+    stack->capacity = capacity;
+    return 1;
+}
+
+// index of func in the stack's function table, added if new; -1 if the table is full
+static int
+cexitstack_compact_func_index( cexitstack_compact *stack, cexitstack_func *func )
+{
+    if (stack->length > 0 && stack->func_table[stack->funcs[stack->length - 1]] == func)
+        return stack->funcs[stack->length - 1];
+    for (unsigned int i = 0; i < stack->func_count; i++)
+        if (stack->func_table[i] == func)
+            return (int)i;
+    if (stack->func_count == CEXITSTACK_COMPACT_MAX_FUNCS) return -1;
+    stack->func_table[stack->func_count] = func;
+    return (int)stack->func_count++;
+}
+
+// bit i is set if conditions[i] matches condition, count <= 64
+static uint64_t
+cexitstack_compact_match_mask( const unsigned int *conditions, unsigned int count, unsigned int condition )
+{
+    uint64_t mask = 0;
+    unsigned int i = 0;
+#if defined(CEXITSTACK_COMPACT_AVX2)
+    const __m256i wanted8 = _mm256_set1_epi32( (int)( condition & ~CEXITSTACK_CONDITION_FLAGS ) );
+    const __m256i plain8 = _mm256_set1_epi32( (int)~CEXITSTACK_CONDITION_FLAGS );
+    const __m256i zero8 = _mm256_setzero_si256();
+    for (; i + 8 <= count; i += 8) {
+        __m256i item_conditions = _mm256_and_si256( _mm256_loadu_si256( (const __m256i *)( conditions + i ) ), plain8 );
+        __m256i always = _mm256_cmpeq_epi32( item_conditions, zero8 );
+        __m256i missed = _mm256_cmpeq_epi32( _mm256_and_si256( item_conditions, wanted8 ), zero8 );
+        unsigned int skipped = (unsigned int)_mm256_movemask_ps( _mm256_castsi256_ps( _mm256_andnot_si256( always, missed ) ) );
+        mask |= (uint64_t)( ~skipped & 0xFFu ) << i;
+    }
+#endif
+#if defined(CEXITSTACK_COMPACT_SSE2)
+    const __m128i wanted4 = _mm_set1_epi32( (int)( condition & ~CEXITSTACK_CONDITION_FLAGS ) );
+    const __m128i plain4 = _mm_set1_epi32( (int)~CEXITSTACK_CONDITION_FLAGS );
+    const __m128i zero4 = _mm_setzero_si128();
+    for (; i + 4 <= count; i += 4) {
+        __m128i item_conditions = _mm_and_si128( _mm_loadu_si128( (const __m128i *)( conditions + i ) ), plain4 );
+        __m128i always = _mm_cmpeq_epi32( item_conditions, zero4 );
+        __m128i missed = _mm_cmpeq_epi32( _mm_and_si128( item_conditions, wanted4 ), zero4 );
+        unsigned int skipped = (unsigned int)_mm_movemask_ps( _mm_castsi128_ps( _mm_andnot_si128( always, missed ) ) );
+        mask |= (uint64_t)( ~skipped & 0xFu ) << i;
+    }
+#endif
+    for (; i < count; i++)
+        if (CEXITSTACK_CONDITION_MATCHES( conditions[i], condition ))
+            mask |= (uint64_t)1 << i;
+    return mask;
+}
+
+// mask must not be 0
+static unsigned int
+cexitstack_compact_highest_bit( uint64_t mask )
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - (unsigned int)__builtin_clzll( mask );
+#elif defined(_MSC_VER) && defined(_M_X64)
+    unsigned long bit;
+    _BitScanReverse64( &bit, mask );
+    return (unsigned int)bit;
+#else
+    unsigned int bit = 0;
+    while (mask >>= 1)
+        bit++;
+    return bit;
+#endif
+}
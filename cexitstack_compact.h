@@ -0,0 +1,27 @@
+#pragma once
+#ifndef CEXITSTACK_COMPACT_H
+#define CEXITSTACK_COMPACT_H
+
+#include "cexitstack.h"
+
+#define CEXITSTACK_COMPACT_MAX_FUNCS 32
+
+typedef struct _cexitstack_compact
+{
+    unsigned int length;
+    unsigned int capacity;
+    unsigned int stack_allocated;
+    unsigned int func_count;
+    void **objects;
+    unsigned int *conditions;
+    unsigned char *funcs;
+    cexitstack_func *func_table[CEXITSTACK_COMPACT_MAX_FUNCS];
+} cexitstack_compact;
+
+extern inline cexitstack_compact *cexitstack_compact_new( unsigned int initial_length );
+extern inline int cexitstack_compact_init( cexitstack_compact *stack, unsigned int initial_length );
+extern inline int cexitstack_compact_return( cexitstack_compact *stack, int return_val, unsigned int condition );
+extern inline int cexitstack_compact_push_full( cexitstack_compact *stack, void *object, unsigned int condition, cexitstack_func *func );
+extern inline void cexitstack_compact_free( cexitstack_compact *stack );
+
+#endif
@@ -0,0 +1,156 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cexitstack_concurrent.h"
+
+#ifndef CEXITSTACK_NOINLINE
+#if defined(__GNUC__) || defined(__clang__)
+#define CEXITSTACK_NOINLINE __attribute__(( noinline ))
+#elif defined(_MSC_VER)
+#define CEXITSTACK_NOINLINE __declspec( noinline )
+#else
+#define CEXITSTACK_NOINLINE
+#endif
+#endif
+
+// Each thread pushes into its own chunk list, found through a one-entry thread-local cache.
+// Stacks get a unique id so that a cache entry never matches a new stack at a reused address.
+typedef struct _cexitstack_concurrent_cache
+{
+    const cexitstack_concurrent *stack;
+    unsigned long long id;
+    cexitstack_concurrent_local *local;
+} cexitstack_concurrent_cache;
+
+static _Thread_local cexitstack_concurrent_cache cexitstack_concurrent_thread_cache;
+static atomic_ullong cexitstack_concurrent_next_id = 1;
+
+static cexitstack_concurrent_local *cexitstack_concurrent_local_get( cexitstack_concurrent *stack );
+static int cexitstack_concurrent_chunk_add( cexitstack_concurrent_local *local );
+static void cexitstack_concurrent_release( cexitstack_concurrent *stack );
+
+inline cexitstack_concurrent *
+cexitstack_concurrent_new( void )
+{
+    cexitstack_concurrent *stack = malloc( sizeof( cexitstack_concurrent ) );
+    if (!stack) return NULL;
+    cexitstack_concurrent_init( stack );
+    stack->stack_allocated = 1;
+    return stack;
+}
+
+inline int
+cexitstack_concurrent_init( cexitstack_concurrent *stack )
+{
+    if (!stack) return 0;
+    atomic_init( &stack->locals, NULL );
+    stack->id = atomic_fetch_add_explicit( &cexitstack_concurrent_next_id, 1, memory_order_relaxed );
+    stack->stack_allocated = 0;
+    return 1;
+}
+
+// must only be called once every thread that pushed onto the stack is done with it (e.g. joined);
+// threads are unwound newest first, each in LIFO order
+inline int
+cexitstack_concurrent_return( cexitstack_concurrent *stack, int return_val, unsigned int condition )
+{
+    cexitstack_concurrent_local *local = atomic_load_explicit( &stack->locals, memory_order_acquire );
+    for (; local; local = local->next) {
+        for (cexitstack_concurrent_chunk *chunk = local->chunk; chunk; chunk = chunk->previous) {
+            unsigned int i = chunk->length;
+            while (i-- > 0) {
+                cexitstack_item *item = chunk->items + i;
+                if (CEXITSTACK_CONDITION_MATCHES( item->condition, condition ))
+                    ( *item->func )( item->object );
+            }
+        }
+    }
+    cexitstack_concurrent_free( stack );
+    return return_val;
+}
+
+// lock-free: a thread's first push onto a stack publishes its chunk list with a CAS, later pushes are plain stores
+inline int
+cexitstack_concurrent_push_full( cexitstack_concurrent *stack, void *object, unsigned int condition, cexitstack_func *func )
+{
+    cexitstack_concurrent_local *local = cexitstack_concurrent_local_get( stack );
+    if (!local) return 0;
+    cexitstack_concurrent_chunk *chunk = local->chunk;
+    if (chunk->length == CEXITSTACK_CONCURRENT_CHUNK_CAPACITY) {
+        if (!cexitstack_concurrent_chunk_add( local ))
+            return 0;
+        chunk = local->chunk;
+    }
+    chunk->items[chunk->length++] = ( cexitstack_item ){ .object = object, .condition = condition, .func = func };
+    return 1;
+}
+
+inline void
+cexitstack_concurrent_free( cexitstack_concurrent *stack )
+{
+    if (!stack) return;
+    cexitstack_concurrent_local *local = atomic_load_explicit( &stack->locals, memory_order_acquire );
+    while (local) {
+        cexitstack_concurrent_local *next = local->next;
+        cexitstack_concurrent_chunk *chunk = local->chunk;
+        while (chunk) {
+            cexitstack_concurrent_chunk *previous = chunk->previous;
+            free( chunk );
+            chunk = previous;
+        }
+        free( local );
+        local = next;
+    }
+    atomic_store_explicit( &stack->locals, NULL, memory_order_relaxed );
+    cexitstack_concurrent_release( stack );
+}
+
+// out of line, or inlining cexitstack_concurrent_free makes GCC warn about freeing stacks that live
+// on the caller's frame
+CEXITSTACK_NOINLINE static void
+cexitstack_concurrent_release( cexitstack_concurrent *stack )
+{
+    if (stack->stack_allocated)
+        free( stack );
+}
+
+static cexitstack_concurrent_local *
+cexitstack_concurrent_local_get( cexitstack_concurrent *stack )
+{
+    cexitstack_concurrent_cache *cache = &cexitstack_concurrent_thread_cache;
+    if (cache->stack == stack && cache->id == stack->id)
+        return cache->local;
+    // the address of the thread-local cache identifies the calling thread
+    cexitstack_concurrent_local *local = atomic_load_explicit( &stack->locals, memory_order_acquire );
+    for (; local; local = local->next)
+        if (local->owner == cache)
+            break;
+    if (!local) {
+        local = malloc( sizeof( cexitstack_concurrent_local ) );
+        if (!local) return NULL;
+        local->owner = cache;
+        local->chunk = NULL;
+        if (!cexitstack_concurrent_chunk_add( local )) {
+            free( local );
+            return NULL;
+        }
+        local->next = atomic_load_explicit( &stack->locals, memory_order_relaxed );
+        while (!atomic_compare_exchange_weak_explicit( &stack->locals, &local->next, local, memory_order_release, memory_order_relaxed ))
+            ;
+    }
+    cache->stack = stack;
+    cache->id = stack->id;
+    cache->local = local;
+    return local;
+}
+
+static int
+cexitstack_concurrent_chunk_add( cexitstack_concurrent_local *local )
+{
+    cexitstack_concurrent_chunk *chunk = malloc( sizeof( cexitstack_concurrent_chunk ) );
+    if (!chunk) return 0;
+    chunk->previous = local->chunk;
+    chunk->length = 0;
+    local->chunk = chunk;
+    return 1;
+}
@@ -0,0 +1,39 @@
+#pragma once
+#ifndef CEXITSTACK_CONCURRENT_H
+#define CEXITSTACK_CONCURRENT_H
+
+#include <stdatomic.h>
+
+#include "cexitstack.h"
+
+#define CEXITSTACK_CONCURRENT_CHUNK_CAPACITY 64
+
+typedef struct _cexitstack_concurrent_chunk
+{
+    struct _cexitstack_concurrent_chunk *previous;
+    unsigned int length;
+    cexitstack_item items[CEXITSTACK_CONCURRENT_CHUNK_CAPACITY];
+} cexitstack_concurrent_chunk;
+
+// the items pushed by one thread, as a list of chunks, newest first
+typedef struct _cexitstack_concurrent_local
+{
+    struct _cexitstack_concurrent_local *next;
+    const void *owner;
+    cexitstack_concurrent_chunk *chunk;
+} cexitstack_concurrent_local;
+
+typedef struct _cexitstack_concurrent
+{
+    _Atomic( cexitstack_concurrent_local * ) locals;
+    unsigned long long id;
+    unsigned int stack_allocated;
+} cexitstack_concurrent;
+
+extern inline cexitstack_concurrent *cexitstack_concurrent_new( void );
+extern inline int cexitstack_concurrent_init( cexitstack_concurrent *stack );
+extern inline int cexitstack_concurrent_return( cexitstack_concurrent *stack, int return_val, unsigned int condition );
+extern inline int cexitstack_concurrent_push_full( cexitstack_concurrent *stack, void *object, unsigned int condition, cexitstack_func *func );
+extern inline void cexitstack_concurrent_free( cexitstack_concurrent *stack );
+
+#endif
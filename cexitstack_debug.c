@@ -0,0 +1,439 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <threads.h>
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define CEXITSTACK_DEBUG_HAS_BACKTRACE
+#endif
+
+#include "cexitstack_debug.h"
+
+// set before starting threads; NULL for cexitstack_debug_print
+static cexitstack_debug_handler *cexitstack_debug_handler_func;
+
+#ifdef CEXITSTACK_DEBUG
+static void cexitstack_debug_report( cexitstack_debug_anomaly *anomaly, int with_backtrace );
+static void cexitstack_debug_print( const cexitstack_debug_anomaly *anomaly );
+
+typedef struct _cexitstack_debug_registry cexitstack_debug_registry;
+
+typedef struct _cexitstack_debug_record
+{
+    struct _cexitstack_debug_record *prev;
+    struct _cexitstack_debug_record *next;
+    cexitstack_debug_registry *registry;
+    const cexitstack *stack;
+    const char *file;
+    int line;
+    unsigned int reported;
+    // Positions + 1 of the stack's items, open addressing on the object, built once the stack gets
+    // deep. Popped items aren't removed: an entry only counts while its position is below the new
+    // item and still holds the same object and cleanup. Stale entries go when the set is rebuilt.
+    unsigned int *set;
+    unsigned int set_mask;
+    unsigned int set_used;
+} cexitstack_debug_record;
+
+// The live stacks created by one thread. Stacks may be freed on another thread, so the list is
+// locked. Registries are never freed: when a thread exits, its leaks are reported and the
+// registry can be taken over by a new thread once they're gone.
+struct _cexitstack_debug_registry
+{
+    cexitstack_debug_registry *next;
+    mtx_t lock;
+    cexitstack_debug_record *live;
+    unsigned int count;
+    unsigned int exited;
+};
+
+static once_flag cexitstack_debug_once = ONCE_FLAG_INIT;
+static int cexitstack_debug_ready;
+static tss_t cexitstack_debug_key;
+static mtx_t cexitstack_debug_registries_lock;
+static cexitstack_debug_registry *cexitstack_debug_registries;
+static _Thread_local cexitstack_debug_registry *cexitstack_debug_thread_registry;
+// set by the wrappers in cexitstack.h right before the stack is created
+static _Thread_local const char *cexitstack_debug_site_file;
+static _Thread_local int cexitstack_debug_site_line;
+
+static void cexitstack_debug_init( void );
+static void cexitstack_debug_thread_exit( void *registry );
+static void cexitstack_debug_process_exit( void );
+static cexitstack_debug_registry *cexitstack_debug_registry_get( void );
+static unsigned int cexitstack_debug_report_leaks( cexitstack_debug_registry *registry );
+static int cexitstack_debug_tracked( const cexitstack_item *item );
+static const void *cexitstack_debug_item_key( const cexitstack *stack, unsigned int position );
+static int cexitstack_debug_same( const cexitstack *stack, unsigned int position, unsigned int other );
+static unsigned int cexitstack_debug_scan( const cexitstack *stack, unsigned int position );
+static int cexitstack_debug_rebuild( cexitstack_debug_record *record, const cexitstack *stack, unsigned int position );
+static unsigned int cexitstack_debug_insert( cexitstack_debug_record *record, const cexitstack *stack, unsigned int position );
+#endif
+
+// NULL restores the default handler, which prints to stderr
+inline void
+cexitstack_debug_set_handler( cexitstack_debug_handler *handler )
+{
+    cexitstack_debug_handler_func = handler;
+}
+
+// number of stacks created by the calling thread that are still alive
+inline unsigned int
+cexitstack_debug_live( void )
+{
+#ifdef CEXITSTACK_DEBUG
+    cexitstack_debug_registry *registry = cexitstack_debug_thread_registry;
+    if (!registry) return 0;
+    mtx_lock( &registry->lock );
+    unsigned int count = registry->count;
+    mtx_unlock( &registry->lock );
+    return count;
+#else
+    return 0;
+#endif
+}
+
+// reports the calling thread's live stacks as leaks now, e.g. at the end of a request, and returns
+// how many were reported; every stack is reported once
+inline unsigned int
+cexitstack_debug_check( void )
+{
+#ifdef CEXITSTACK_DEBUG
+    cexitstack_debug_registry *registry = cexitstack_debug_thread_registry;
+    return registry ? cexitstack_debug_report_leaks( registry ) : 0;
+#else
+    return 0;
+#endif
+}
+
+#ifdef CEXITSTACK_DEBUG
+inline void
+cexitstack_debug_site( const char *file, int line )
+{
+    cexitstack_debug_site_file = file;
+    cexitstack_debug_site_line = line;
+}
+
+// without memory for the record, the stack just isn't tracked
+inline void
+cexitstack_debug_created( cexitstack *stack )
+{
+    const char *file = cexitstack_debug_site_file;
+    cexitstack_debug_site_file = NULL;
+    cexitstack_debug_registry *registry = cexitstack_debug_registry_get();
+    if (!registry) return;
+    cexitstack_debug_record *record = calloc( 1, sizeof( cexitstack_debug_record ) );
+    if (!record) return;
+    record->registry = registry;
+    record->stack = stack;
+    record->file = file ? file : "(unknown)";
+    record->line = file ? cexitstack_debug_site_line : 0;
+    mtx_lock( &registry->lock );
+    record->next = registry->live;
+    if (registry->live) registry->live->prev = record;
+    registry->live = record;
+    registry->count++;
+    mtx_unlock( &registry->lock );
+    stack->debug = record;
+}
+
+inline void
+cexitstack_debug_released( cexitstack *stack )
+{
+    cexitstack_debug_record *record = stack->debug;
+    if (!record) return;
+    cexitstack_debug_registry *registry = record->registry;
+    mtx_lock( &registry->lock );
+    if (record->prev) record->prev->next = record->next;
+    else registry->live = record->next;
+    if (record->next) record->next->prev = record->prev;
+    registry->count--;
+    mtx_unlock( &registry->lock );
+    free( record->set );
+    free( record );
+    stack->debug = NULL;
+}
+
+// checks the item just pushed at position against the items under it
+inline void
+cexitstack_debug_pushed( const cexitstack *stack, unsigned int position )
+{
+    cexitstack_debug_record *record = stack->debug;
+    const cexitstack_item *item = stack->items + position;
+    if (!cexitstack_debug_tracked( item )) return;
+    // an args item's payload sits in the slot under it
+    unsigned int bottom = item->condition & CEXITSTACK_CONDITION_ARGS ? position - 1 : position;
+    unsigned int previous;
+    if (!record->set && bottom < CEXITSTACK_DEBUG_SCAN_MAX) {
+        previous = cexitstack_debug_scan( stack, position );
+    }
+    else {
+        if (( record->set_used + 1ull ) * 2 > record->set_mask + 1ull && !cexitstack_debug_rebuild( record, stack, position ))
+            return;
+        previous = cexitstack_debug_insert( record, stack, position );
+    }
+    if (previous == UINT_MAX) return;
+    cexitstack_debug_anomaly anomaly = { .kind = CEXITSTACK_DEBUG_DUPLICATE, .stack = stack, .file = record->file, .line = record->line,
+                                         .object = (void *)cexitstack_debug_item_key( stack, position ), .func = item->func,
+                                         .position = position, .previous_position = previous };
+    cexitstack_debug_report( &anomaly, 1 );
+}
+
+// checks the rollback item just pushed at index against the rollback segment under it; the segment
+// is dropped as a whole on commit, so it's short-lived and scanned
+inline void
+cexitstack_debug_rollback_pushed( const cexitstack *stack, unsigned int index )
+{
+    const cexitstack_rollback_item *item = stack->rollback + index;
+    if (!item->object || !item->func) return;
+    unsigned int i = index;
+    while (i > 0) {
+        const cexitstack_rollback_item *below = stack->rollback + --i;
+        if (below->object != item->object || below->func != item->func) continue;
+        cexitstack_debug_record *record = stack->debug;
+        cexitstack_debug_anomaly anomaly = { .kind = CEXITSTACK_DEBUG_DUPLICATE, .stack = stack, .file = record->file, .line = record->line,
+                                             .object = item->object, .func = item->func, .position = index,
+                                             .previous_position = i, .rollback = 1 };
+        cexitstack_debug_report( &anomaly, 1 );
+        return;
+    }
+}
+
+inline _Noreturn void
+cexitstack_debug_overflow( const char *file, int line, unsigned int capacity )
+{
+    cexitstack_debug_anomaly anomaly = { .kind = CEXITSTACK_DEBUG_OVERFLOW, .file = file, .line = line, .capacity = capacity };
+    cexitstack_debug_report( &anomaly, 1 );
+    abort();
+}
+
+static void
+cexitstack_debug_init( void )
+{
+    if (tss_create( &cexitstack_debug_key, &cexitstack_debug_thread_exit ) != thrd_success) return;
+    if (mtx_init( &cexitstack_debug_registries_lock, mtx_plain ) != thrd_success) {
+        tss_delete( cexitstack_debug_key );
+        return;
+    }
+    atexit( &cexitstack_debug_process_exit );
+    cexitstack_debug_ready = 1;
+}
+
+// tss destructor, not called for the thread calling exit()
+static void
+cexitstack_debug_thread_exit( void *registry )
+{
+    cexitstack_debug_registry *thread_registry = registry;
+    cexitstack_debug_report_leaks( thread_registry );
+    mtx_lock( &cexitstack_debug_registries_lock );
+    mtx_lock( &thread_registry->lock );
+    thread_registry->exited = 1;
+    mtx_unlock( &thread_registry->lock );
+    mtx_unlock( &cexitstack_debug_registries_lock );
+}
+
+// registries are only ever added at the head, so the list can be walked from a snapshot of it
+static void
+cexitstack_debug_process_exit( void )
+{
+    mtx_lock( &cexitstack_debug_registries_lock );
+    cexitstack_debug_registry *registry = cexitstack_debug_registries;
+    mtx_unlock( &cexitstack_debug_registries_lock );
+    for (; registry; registry = registry->next)
+        cexitstack_debug_report_leaks( registry );
+}
+
+static cexitstack_debug_registry *
+cexitstack_debug_registry_get( void )
+{
+    cexitstack_debug_registry *registry = cexitstack_debug_thread_registry;
+    if (registry) return registry;
+    call_once( &cexitstack_debug_once, &cexitstack_debug_init );
+    if (!cexitstack_debug_ready) return NULL;
+    mtx_lock( &cexitstack_debug_registries_lock );
+    for (registry = cexitstack_debug_registries; registry; registry = registry->next) {
+        mtx_lock( &registry->lock );
+        int vacant = registry->exited && !registry->count;
+        if (vacant) registry->exited = 0;
+        mtx_unlock( &registry->lock );
+        if (vacant) break;
+    }
+    if (!registry) {
+        registry = calloc( 1, sizeof( cexitstack_debug_registry ) );
+        if (registry && mtx_init( &registry->lock, mtx_plain ) != thrd_success) {
+            free( registry );
+            registry = NULL;
+        }
+        if (registry) {
+            registry->next = cexitstack_debug_registries;
+            cexitstack_debug_registries = registry;
+        }
+    }
+    mtx_unlock( &cexitstack_debug_registries_lock );
+    if (!registry) return NULL;
+    tss_set( cexitstack_debug_key, registry );
+    cexitstack_debug_thread_registry = registry;
+    return registry;
+}
+
+// the handler runs without the registry locked, so it may create and free stacks
+static unsigned int
+cexitstack_debug_report_leaks( cexitstack_debug_registry *registry )
+{
+    unsigned int reported = 0;
+    for (;;) {
+        cexitstack_debug_anomaly anomaly = { .kind = CEXITSTACK_DEBUG_LEAK };
+        mtx_lock( &registry->lock );
+        cexitstack_debug_record *record = registry->live;
+        while (record && record->reported)
+            record = record->next;
+        if (record) {
+            record->reported = 1;
+            anomaly.stack = record->stack;
+            anomaly.file = record->file;
+            anomaly.line = record->line;
+        }
+        mtx_unlock( &registry->lock );
+        if (!record) return reported;
+        cexitstack_debug_report( &anomaly, 0 );
+        reported++;
+    }
+}
+
+// NULL objects and scope markers aren't tracked; args items have no object, their payload counts
+static int
+cexitstack_debug_tracked( const cexitstack_item *item )
+{
+    return item->func && ( item->object || item->condition & CEXITSTACK_CONDITION_ARGS );
+}
+
+// what a tracked item is hashed by: its object, or the first word of its args
+static const void *
+cexitstack_debug_item_key( const cexitstack *stack, unsigned int position )
+{
+    const cexitstack_item *item = stack->items + position;
+    if (item->condition & CEXITSTACK_CONDITION_ARGS)
+        return ( (const cexitstack_args *)( item - 1 ) )->arg[0].pointer;
+    return item->object;
+}
+
+// whether the items at position and other run the same cleanup on the same object or args; other
+// may be a stale position from the set, which an args payload can occupy now
+static int
+cexitstack_debug_same( const cexitstack *stack, unsigned int position, unsigned int other )
+{
+    const cexitstack_item *item = stack->items + position, *below = stack->items + other;
+    if (below->func != item->func || ( below->condition ^ item->condition ) & CEXITSTACK_CONDITION_ARGS) return 0;
+    if (item->condition & CEXITSTACK_CONDITION_ARGS)
+        return other > 0 && memcmp( item - 1, below - 1, sizeof( cexitstack_args ) ) == 0;
+    return below->object == item->object;
+}
+
+// returns the position of an item below position with the same cleanup and object or args, or UINT_MAX
+static unsigned int
+cexitstack_debug_scan( const cexitstack *stack, unsigned int position )
+{
+    unsigned int i = stack->items[position].condition & CEXITSTACK_CONDITION_ARGS ? position - 1 : position;
+    while (i > 0) {
+        const cexitstack_item *below = stack->items + --i;
+        if (cexitstack_debug_tracked( below ) && cexitstack_debug_same( stack, position, i )) return i;
+        // skips the args slot under an args item too
+        if (below->condition & CEXITSTACK_CONDITION_ARGS) i--;
+    }
+    return UINT_MAX;
+}
+
+static unsigned int
+cexitstack_debug_hash( const void *object, unsigned int mask )
+{
+    return (unsigned int)( ( (uint64_t)(uintptr_t)object * 0x9E3779B97F4A7C15ull ) >> 32 ) & mask;
+}
+
+// replaces the set with one holding just the tracked items below position, with room to grow
+static int
+cexitstack_debug_rebuild( cexitstack_debug_record *record, const cexitstack *stack, unsigned int position )
+{
+    unsigned long long capacity = 4 * CEXITSTACK_DEBUG_SCAN_MAX;
+    while (capacity < 4ull * ( position + 1ull ))
+        capacity *= 2;
+    if (capacity > UINT_MAX) return 0;
+    unsigned int *set = calloc( (size_t)capacity, sizeof( unsigned int ) );
+    if (!set) return 0;
+    unsigned int mask = (unsigned int)( capacity - 1 );
+    unsigned int used = 0;
+    unsigned int i = stack->items[position].condition & CEXITSTACK_CONDITION_ARGS ? position - 1 : position;
+    while (i > 0) {
+        unsigned int at = --i;
+        const cexitstack_item *item = stack->items + at;
+        if (item->condition & CEXITSTACK_CONDITION_ARGS) i--;
+        if (!cexitstack_debug_tracked( item )) continue;
+        unsigned int slot = cexitstack_debug_hash( cexitstack_debug_item_key( stack, at ), mask );
+        while (set[slot])
+            slot = ( slot + 1 ) & mask;
+        set[slot] = at + 1;
+        used++;
+    }
+    free( record->set );
+    record->set = set;
+    record->set_mask = mask;
+    record->set_used = used;
+    return 1;
+}
+
+// adds the item at position, returns the position of a live duplicate of it or UINT_MAX
+static unsigned int
+cexitstack_debug_insert( cexitstack_debug_record *record, const cexitstack *stack, unsigned int position )
+{
+    unsigned int slot = cexitstack_debug_hash( cexitstack_debug_item_key( stack, position ), record->set_mask );
+    while (record->set[slot]) {
+        unsigned int other = record->set[slot] - 1;
+        if (other < position && cexitstack_debug_same( stack, position, other ))
+            return other;
+        slot = ( slot + 1 ) & record->set_mask;
+    }
+    record->set[slot] = position + 1;
+    record->set_used++;
+    return UINT_MAX;
+}
+
+static void
+cexitstack_debug_report( cexitstack_debug_anomaly *anomaly, int with_backtrace )
+{
+#ifdef CEXITSTACK_DEBUG_HAS_BACKTRACE
+    if (with_backtrace) {
+        int frames = backtrace( anomaly->backtrace, CEXITSTACK_DEBUG_BACKTRACE_MAX );
+        anomaly->frames = frames > 0 ? (unsigned int)frames : 0;
+    }
+#else
+    (void)with_backtrace;
+#endif
+    cexitstack_debug_handler *handler = cexitstack_debug_handler_func;
+    ( handler ? handler : &cexitstack_debug_print )( anomaly );
+}
+
+static void
+cexitstack_debug_print( const cexitstack_debug_anomaly *anomaly )
+{
+    switch (anomaly->kind) {
+    case CEXITSTACK_DEBUG_LEAK:
+        fprintf( stderr, "cexitstack: stack %p created at %s:%d was never returned\n", (const void *)anomaly->stack, anomaly->file, anomaly->line );
+        break;
+    case CEXITSTACK_DEBUG_DUPLICATE:
+        fprintf( stderr, "cexitstack: object %p pushed with the same cleanup as %sitem %u again as item %u, stack %p created at %s:%d\n",
+                 anomaly->object, anomaly->rollback ? "rollback " : "", anomaly->previous_position, anomaly->position,
+                 (const void *)anomaly->stack, anomaly->file, anomaly->line );
+        break;
+    case CEXITSTACK_DEBUG_OVERFLOW:
+        fprintf( stderr, "cexitstack: push beyond the capacity of %u at %s:%d\n", anomaly->capacity, anomaly->file, anomaly->line );
+        break;
+    }
+#ifdef CEXITSTACK_DEBUG_HAS_BACKTRACE
+    if (anomaly->frames) {
+        fflush( stderr );
+        backtrace_symbols_fd( (void *const *)anomaly->backtrace, (int)anomaly->frames, 2 );
+    }
+#endif
+}
+#endif
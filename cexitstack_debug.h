@@ -0,0 +1,49 @@
+#pragma once
+#ifndef CEXITSTACK_DEBUG_H
+#define CEXITSTACK_DEBUG_H
+
+#include "cexitstack.h"
+
+// Leak and misuse checks, compiled in only when CEXITSTACK_DEBUG is defined (for the library and
+// everything including cexitstack.h). Every stack created with cexitstack_new, cexitstack_init or
+// cexitstack_init_inline is registered with the call site that created it, and unregistered by
+// cexitstack_free/cexitstack_return. Stacks still registered when their thread or the process exits
+// are reported, as are pushes of an object with the same cleanup as an item already on the stack,
+// and CEXITSTACK_PUSH overflows. Contexts' stacks and the other stack types aren't tracked.
+
+#define CEXITSTACK_DEBUG_LEAK 1      // a stack was never returned or freed
+#define CEXITSTACK_DEBUG_DUPLICATE 2 // an object was pushed with the same cleanup twice
+#define CEXITSTACK_DEBUG_OVERFLOW 3  // CEXITSTACK_PUSH or CEXITSTACK_PUSH_ARGS on a full stack
+#define CEXITSTACK_DEBUG_BACKTRACE_MAX 16
+// below this depth, a push is checked for duplicates by scanning the items under it
+#define CEXITSTACK_DEBUG_SCAN_MAX 8
+
+typedef struct _cexitstack_debug_anomaly
+{
+    unsigned int kind;
+    // the stack, NULL for overflows; a leaked stack may be gone already and mustn't be dereferenced
+    const cexitstack *stack;
+    // where the stack was created, or where the overflowing push is
+    const char *file;
+    int line;
+    // duplicates: the object (for args items the first word of the args) and cleanup, and the
+    // positions of both items; with rollback set, both are indices into the rollback segment
+    void *object;
+    cexitstack_func *func;
+    unsigned int position;
+    unsigned int previous_position;
+    int rollback;
+    // overflows: the capacity of the stack
+    unsigned int capacity;
+    // where a duplicate or overflow was detected, on platforms with backtrace()
+    unsigned int frames;
+    void *backtrace[CEXITSTACK_DEBUG_BACKTRACE_MAX];
+} cexitstack_debug_anomaly;
+
+typedef void cexitstack_debug_handler( const cexitstack_debug_anomaly *anomaly );
+
+extern inline void cexitstack_debug_set_handler( cexitstack_debug_handler *handler );
+extern inline unsigned int cexitstack_debug_live( void );
+extern inline unsigned int cexitstack_debug_check( void );
+
+#endif
@@ -0,0 +1,335 @@
+#ifndef _XOPEN_SOURCE
+#define _XOPEN_SOURCE 700
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "cexitstack_persist.h"
+
+#ifndef _WIN32
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+
+// The file starts with a header and is followed by the log: push records, each describing one entry,
+// and pop records removing the topmost entries again. A record's size is cleared first and stored
+// last, so a record cut short by a crash reads as the end of the log, even where it overwrites one
+// from an older generation. So does a record from an older generation: the
+// log only grows within a generation, and starts over at the beginning with the next one whenever
+// the stack is empty.
+#define CEXITSTACK_PERSIST_MAGIC "CEXSTKP1"
+#define CEXITSTACK_PERSIST_PUSH 1
+#define CEXITSTACK_PERSIST_POP 2
+
+typedef struct _cexitstack_persist_header
+{
+    char magic[8];
+    _Atomic uint32_t generation;
+    uint32_t reserved;
+} cexitstack_persist_header;
+
+typedef struct _cexitstack_persist_record
+{
+    _Atomic uint32_t size;
+    uint32_t generation;
+    uint16_t type;
+    uint16_t kind;
+    uint32_t condition;
+    int64_t id;
+    char name[];
+} cexitstack_persist_record;
+
+struct _cexitstack_persist
+{
+    int fd;
+    char *path;
+    unsigned char *map;
+    size_t size;
+    size_t end;
+    size_t synced;
+    unsigned int sync_batch;
+    unsigned int unsynced;
+    uint32_t generation;
+    // log offsets of the live entries' push records, bottom first
+    size_t *entries;
+    unsigned int length;
+    unsigned int capacity;
+};
+
+static int cexitstack_persist_append( cexitstack_persist *stack, unsigned int type, unsigned int kind, unsigned int condition,
+                                      int64_t id, const char *name );
+static int cexitstack_persist_grow( cexitstack_persist *stack, size_t needed );
+static void cexitstack_persist_pop( cexitstack_persist *stack, unsigned int condition );
+static int cexitstack_persist_run( const cexitstack_persist_record *record, int replaying );
+
+// Creates (or truncates) the log file at path. size is the initial file size (0 for the default);
+// the file grows as needed. Every sync_batch appends the new part of the log is written out with
+// msync( MS_SYNC ), 0 leaves that to cexitstack_persist_sync.
+inline cexitstack_persist *
+cexitstack_persist_open( const char *path, size_t size, unsigned int sync_batch )
+{
+    if (!path) return NULL;
+    cexitstack_persist *stack = calloc( 1, sizeof( cexitstack_persist ) );
+    if (!stack) return NULL;
+    stack->size = size > sizeof( cexitstack_persist_header ) ? size : CEXITSTACK_PERSIST_DEFAULT_SIZE;
+    stack->sync_batch = sync_batch;
+    stack->end = stack->synced = sizeof( cexitstack_persist_header );
+    stack->path = malloc( strlen( path ) + 1 );
+    if (!stack->path) goto error;
+    strcpy( stack->path, path );
+    stack->fd = open( path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+    if (stack->fd < 0) goto error;
+    if (ftruncate( stack->fd, (off_t)stack->size ) != 0) goto error_file;
+    stack->map = mmap( NULL, stack->size, PROT_READ | PROT_WRITE, MAP_SHARED, stack->fd, 0 );
+    if (stack->map == MAP_FAILED) goto error_file;
+    cexitstack_persist_header *header = (cexitstack_persist_header *)stack->map;
+    memcpy( header->magic, CEXITSTACK_PERSIST_MAGIC, sizeof( header->magic ) );
+    stack->generation = 1;
+    atomic_store_explicit( &header->generation, stack->generation, memory_order_release );
+    if (msync( stack->map, stack->end, MS_SYNC ) != 0) goto error_map;
+    return stack;
+error_map:
+    munmap( stack->map, stack->size );
+error_file:
+    close( stack->fd );
+    unlink( path );
+error:
+    free( stack->path );
+    free( stack );
+    return NULL;
+}
+
+// kind is one of the name-based CEXITSTACK_PERSIST_* kinds
+inline int
+cexitstack_persist_push_name( cexitstack_persist *stack, unsigned int kind, const char *name, unsigned int condition )
+{
+    if (!stack || !name || strlen( name ) >= CEXITSTACK_PERSIST_NAME_MAX) return 0;
+    if (kind != CEXITSTACK_PERSIST_UNLINK && kind != CEXITSTACK_PERSIST_RMDIR && kind != CEXITSTACK_PERSIST_SHM_UNLINK) return 0;
+    return cexitstack_persist_append( stack, CEXITSTACK_PERSIST_PUSH, kind, condition, 0, name );
+}
+
+// kind is CEXITSTACK_PERSIST_SHMID or CEXITSTACK_PERSIST_CLOSE
+inline int
+cexitstack_persist_push_id( cexitstack_persist *stack, unsigned int kind, long id, unsigned int condition )
+{
+    if (!stack || ( kind != CEXITSTACK_PERSIST_SHMID && kind != CEXITSTACK_PERSIST_CLOSE )) return 0;
+    return cexitstack_persist_append( stack, CEXITSTACK_PERSIST_PUSH, kind, condition, id, NULL );
+}
+
+inline unsigned int
+cexitstack_persist_mark( const cexitstack_persist *stack )
+{
+    return stack->length;
+}
+
+// Entries are popped (and logged as popped) one at a time after they've run, so a crash halfway
+// leaves at most the entry that was running to be run again by the replay.
+inline int
+cexitstack_persist_unwind_to( cexitstack_persist *stack, unsigned int mark, unsigned int condition )
+{
+    if (!stack || mark > stack->length) return 0;
+    while (stack->length > mark)
+        cexitstack_persist_pop( stack, condition );
+    return 1;
+}
+
+// writes the part of the log appended since the last sync to the file
+inline int
+cexitstack_persist_sync( cexitstack_persist *stack )
+{
+    stack->unsynced = 0;
+    if (stack->end <= stack->synced) return 1;
+    size_t page = (size_t)sysconf( _SC_PAGESIZE );
+    size_t begin = stack->synced / page * page;
+    if (msync( stack->map + begin, stack->end - begin, MS_SYNC ) != 0) return 0;
+    stack->synced = stack->end;
+    return 1;
+}
+
+// runs all entries like cexitstack_return, then removes the log file
+inline int
+cexitstack_persist_return( cexitstack_persist *stack, int return_val, unsigned int condition )
+{
+    if (!stack) return return_val;
+    cexitstack_persist_unwind_to( stack, 0, condition );
+    unlink( stack->path );
+    cexitstack_persist_close( stack );
+    return return_val;
+}
+
+// releases the stack without running anything and leaves the log file for cexitstack_persist_replay
+inline void
+cexitstack_persist_close( cexitstack_persist *stack )
+{
+    if (!stack) return;
+    cexitstack_persist_sync( stack );
+    munmap( stack->map, stack->size );
+    close( stack->fd );
+    free( stack->entries );
+    free( stack->path );
+    free( stack );
+}
+
+// For a supervisor, after the process that wrote the log at path is gone: runs the entries it
+// left behind in LIFO order, like cexitstack_return with the given condition (typically
+// CEXITSTACK_CONDITION_ERROR). Returns the number of entries run, -1 if the log can't be read.
+// The log file is left in place; remove it once the replay is done.
+inline int
+cexitstack_persist_replay( const char *path, unsigned int condition )
+{
+    int fd = open( path, O_RDONLY | O_CLOEXEC );
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat( fd, &st ) != 0 || (size_t)st.st_size < sizeof( cexitstack_persist_header )) {
+        close( fd );
+        return -1;
+    }
+    size_t size = (size_t)st.st_size;
+    unsigned char *map = mmap( NULL, size, PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if (map == MAP_FAILED) return -1;
+    const cexitstack_persist_header *header = (const cexitstack_persist_header *)map;
+    if (memcmp( header->magic, CEXITSTACK_PERSIST_MAGIC, sizeof( header->magic ) ) != 0) {
+        munmap( map, size );
+        return -1;
+    }
+    uint32_t generation = atomic_load_explicit( &header->generation, memory_order_acquire );
+    size_t *entries = NULL;
+    unsigned int length = 0, capacity = 0;
+    size_t offset = sizeof( cexitstack_persist_header );
+    while (size - offset >= sizeof( cexitstack_persist_record )) {
+        const cexitstack_persist_record *record = (const cexitstack_persist_record *)( map + offset );
+        uint32_t record_size = atomic_load_explicit( &record->size, memory_order_acquire );
+        if (record_size < sizeof( cexitstack_persist_record ) || record_size > size - offset || record->generation != generation)
+            break;
+        if (record->type == CEXITSTACK_PERSIST_PUSH) {
+            if (length == capacity) {
+                unsigned int new_capacity = capacity ? capacity * 2 : 64;
+                size_t *new_entries = realloc( entries, sizeof( size_t ) * new_capacity );
+                if (!new_entries) {
+                    free( entries );
+                    munmap( map, size );
+                    return -1;
+                }
+                entries = new_entries;
+                capacity = new_capacity;
+            }
+            entries[length++] = offset;
+        }
+        else if (record->type == CEXITSTACK_PERSIST_POP) {
+            length -= record->id < length ? (unsigned int)record->id : length;
+        }
+        offset += record_size;
+    }
+    int executed = 0;
+    while (length > 0) {
+        const cexitstack_persist_record *record = (const cexitstack_persist_record *)( map + entries[--length] );
+        if (CEXITSTACK_CONDITION_MATCHES( record->condition, condition ))
+            executed += cexitstack_persist_run( record, 1 );
+    }
+    free( entries );
+    munmap( map, size );
+    return executed;
+}
+
+static int
+cexitstack_persist_append( cexitstack_persist *stack, unsigned int type, unsigned int kind, unsigned int condition,
+                           int64_t id, const char *name )
+{
+    size_t name_length = name ? strlen( name ) + 1 : 0;
+    size_t record_size = ( sizeof( cexitstack_persist_record ) + name_length + 7 ) & ~(size_t)7;
+    if (type == CEXITSTACK_PERSIST_PUSH && stack->length == stack->capacity) {
+        unsigned int new_capacity = stack->capacity ? stack->capacity * 2 : 64;
+        size_t *new_entries = realloc( stack->entries, sizeof( size_t ) * new_capacity );
+        if (!new_entries) return 0;
+        stack->entries = new_entries;
+        stack->capacity = new_capacity;
+    }
+    if (stack->size - stack->end < record_size)
+        if (!cexitstack_persist_grow( stack, record_size ))
+            return 0;
+    cexitstack_persist_record *record = (cexitstack_persist_record *)( stack->map + stack->end );
+    // a stale record may sit here, with a size that would pass for this one's once the generation is
+    // written; a crash happens between two stores of this thread, so a compiler barrier keeps the order
+    atomic_store_explicit( &record->size, 0, memory_order_relaxed );
+    atomic_signal_fence( memory_order_seq_cst );
+    record->generation = stack->generation;
+    record->type = (uint16_t)type;
+    record->kind = (uint16_t)kind;
+    record->condition = condition;
+    record->id = id;
+    if (name) memcpy( record->name, name, name_length );
+    atomic_store_explicit( &record->size, (uint32_t)record_size, memory_order_release );
+    if (type == CEXITSTACK_PERSIST_PUSH)
+        stack->entries[stack->length++] = stack->end;
+    stack->end += record_size;
+    if (stack->sync_batch && ++stack->unsynced >= stack->sync_batch)
+        cexitstack_persist_sync( stack );
+    return 1;
+}
+
+// doubles the file (at least) and maps it again; the records' offsets stay the same
+static int
+cexitstack_persist_grow( cexitstack_persist *stack, size_t needed )
+{
+    size_t new_size = stack->size * 2;
+    if (new_size < stack->end + needed) new_size = stack->end + needed;
+    if (ftruncate( stack->fd, (off_t)new_size ) != 0) return 0;
+    unsigned char *map = mmap( NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, stack->fd, 0 );
+    if (map == MAP_FAILED) return 0;
+    munmap( stack->map, stack->size );
+    stack->map = map;
+    stack->size = new_size;
+    return 1;
+}
+
+static void
+cexitstack_persist_pop( cexitstack_persist *stack, unsigned int condition )
+{
+    const cexitstack_persist_record *record = (const cexitstack_persist_record *)( stack->map + stack->entries[stack->length - 1] );
+    if (CEXITSTACK_CONDITION_MATCHES( record->condition, condition ))
+        cexitstack_persist_run( record, 0 );
+    if (stack->length == 1) {
+        // empty again: start a new generation at the beginning of the log instead of logging the pop
+        cexitstack_persist_header *header = (cexitstack_persist_header *)stack->map;
+        stack->length = 0;
+        stack->end = stack->synced = sizeof( cexitstack_persist_header );
+        atomic_store_explicit( &header->generation, ++stack->generation, memory_order_release );
+        if (stack->sync_batch) msync( stack->map, stack->end, MS_SYNC );
+        stack->unsynced = 0;
+        return;
+    }
+    // if the pop can't be logged, a replay may run the entry again
+    cexitstack_persist_append( stack, CEXITSTACK_PERSIST_POP, 0, 0, 1, NULL );
+    stack->length--;
+}
+
+static int
+cexitstack_persist_run( const cexitstack_persist_record *record, int replaying )
+{
+    switch (record->kind) {
+    case CEXITSTACK_PERSIST_UNLINK:
+        unlink( record->name );
+        return 1;
+    case CEXITSTACK_PERSIST_RMDIR:
+        rmdir( record->name );
+        return 1;
+    case CEXITSTACK_PERSIST_SHM_UNLINK:
+        shm_unlink( record->name );
+        return 1;
+    case CEXITSTACK_PERSIST_SHMID:
+        shmctl( (int)record->id, IPC_RMID, NULL );
+        return 1;
+    case CEXITSTACK_PERSIST_CLOSE:
+        if (replaying) return 0;
+        close( (int)record->id );
+        return 1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,37 @@
+#pragma once
+#ifndef CEXITSTACK_PERSIST_H
+#define CEXITSTACK_PERSIST_H
+
+#include "cexitstack.h"
+
+// A stack of cleanups that survive a crash of the process that pushed them: every push and pop is
+// appended to a log in a memory-mapped file, which a supervisor can replay with
+// cexitstack_persist_replay once the process is gone. POSIX only.
+#ifndef _WIN32
+
+#define CEXITSTACK_PERSIST_DEFAULT_SIZE 65536
+#define CEXITSTACK_PERSIST_DEFAULT_SYNC_BATCH 64
+#define CEXITSTACK_PERSIST_NAME_MAX 4096
+
+// what an entry does when it runs
+#define CEXITSTACK_PERSIST_UNLINK 1     // unlink( name )
+#define CEXITSTACK_PERSIST_RMDIR 2      // rmdir( name )
+#define CEXITSTACK_PERSIST_SHM_UNLINK 3 // shm_unlink( name )
+#define CEXITSTACK_PERSIST_SHMID 4      // shmctl( id, IPC_RMID, NULL ), a SysV shared memory segment
+#define CEXITSTACK_PERSIST_CLOSE 5      // close( id ), never replayed: the kernel closes a dead process's fds
+
+typedef struct _cexitstack_persist cexitstack_persist;
+
+extern inline cexitstack_persist *cexitstack_persist_open( const char *path, size_t size, unsigned int sync_batch );
+extern inline int cexitstack_persist_push_name( cexitstack_persist *stack, unsigned int kind, const char *name, unsigned int condition );
+extern inline int cexitstack_persist_push_id( cexitstack_persist *stack, unsigned int kind, long id, unsigned int condition );
+extern inline unsigned int cexitstack_persist_mark( const cexitstack_persist *stack );
+extern inline int cexitstack_persist_unwind_to( cexitstack_persist *stack, unsigned int mark, unsigned int condition );
+extern inline int cexitstack_persist_sync( cexitstack_persist *stack );
+extern inline int cexitstack_persist_return( cexitstack_persist *stack, int return_val, unsigned int condition );
+extern inline void cexitstack_persist_close( cexitstack_persist *stack );
+extern inline int cexitstack_persist_replay( const char *path, unsigned int condition );
+
+#endif
+
+#endif
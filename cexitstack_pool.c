@@ -0,0 +1,214 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+#include "cexitstack_pool.h"
+
+// Every participant (the workers plus the calling thread) owns a range of item indices, packed as
+// ( begin << 32 | end ) into one atomic word. Owners take items from the end, idle participants
+// steal the lower half of another participant's range; both only ever change a range with a CAS.
+struct _cexitstack_pool
+{
+    unsigned int threads;
+    thrd_t *workers;
+    mtx_t run_lock;
+    mtx_t lock;
+    cnd_t wake;
+    cnd_t done;
+    unsigned long long generation;
+    unsigned int busy;
+    int stopping;
+    const cexitstack_item *items;
+    unsigned int condition;
+    _Atomic uint64_t *ranges;
+};
+
+typedef struct _cexitstack_pool_worker_args
+{
+    cexitstack_pool *pool;
+    unsigned int index;
+} cexitstack_pool_worker_args;
+
+static int cexitstack_pool_worker( void *arg );
+static void cexitstack_pool_work( cexitstack_pool *pool, unsigned int self );
+static void cexitstack_pool_run( cexitstack_pool *pool, const cexitstack_item *items, unsigned int begin, unsigned int end, unsigned int condition );
+
+inline cexitstack_pool *
+cexitstack_pool_new( unsigned int threads )
+{
+    cexitstack_pool *pool = calloc( 1, sizeof( cexitstack_pool ) );
+    if (!pool) return NULL;
+    pool->workers = calloc( threads ? threads : 1, sizeof( thrd_t ) );
+    pool->ranges = calloc( threads + 1, sizeof( _Atomic uint64_t ) );
+    if (!pool->workers || !pool->ranges) goto error;
+    if (mtx_init( &pool->run_lock, mtx_plain ) != thrd_success) goto error;
+    if (mtx_init( &pool->lock, mtx_plain ) != thrd_success) goto error_run_lock;
+    if (cnd_init( &pool->wake ) != thrd_success) goto error_lock;
+    if (cnd_init( &pool->done ) != thrd_success) goto error_wake;
+    for (unsigned int i = 0; i < threads; i++) {
+        cexitstack_pool_worker_args *args = malloc( sizeof( cexitstack_pool_worker_args ) );
+        if (args) *args = ( cexitstack_pool_worker_args ){ .pool = pool, .index = i };
+        if (!args || thrd_create( pool->workers + i, &cexitstack_pool_worker, args ) != thrd_success) {
+            free( args );
+            cexitstack_pool_free( pool );
+            return NULL;
+        }
+        pool->threads++;
+    }
+    return pool;
+error_wake:
+    cnd_destroy( &pool->wake );
+error_lock:
+    mtx_destroy( &pool->lock );
+error_run_lock:
+    mtx_destroy( &pool->run_lock );
+error:
+    free( pool->workers );
+    free( pool->ranges );
+    free( pool );
+    return NULL;
+}
+
+inline void
+cexitstack_pool_free( cexitstack_pool *pool )
+{
+    if (!pool) return;
+    mtx_lock( &pool->lock );
+    pool->stopping = 1;
+    cnd_broadcast( &pool->wake );
+    mtx_unlock( &pool->lock );
+    for (unsigned int i = 0; i < pool->threads; i++)
+        thrd_join( pool->workers[i], NULL );
+    cnd_destroy( &pool->done );
+    cnd_destroy( &pool->wake );
+    mtx_destroy( &pool->lock );
+    mtx_destroy( &pool->run_lock );
+    free( pool->workers );
+    free( pool->ranges );
+    free( pool );
+}
+
+// Like cexitstack_return, but runs of matching items flagged CEXITSTACK_CONDITION_INDEPENDENT are
+// spread over the pool. Other matching items run on the calling thread in strict LIFO order, and a
+// run of independent items completes before the next ordered item below it starts.
+inline int
+cexitstack_return_parallel( cexitstack *stack, int return_val, unsigned int condition, cexitstack_pool *pool )
+{
+    // rollback items are interleaved with the others by position, leave those stacks to cexitstack_return
+    if (stack->rollback_length) return cexitstack_return( stack, return_val, condition );
+    unsigned int i = stack->items ? stack->length : 0;
+    while (i > 0) {
+        const cexitstack_item *item = stack->items + i - 1;
+        // args items always run here, the pool only gets single-slot items
+        if (!CEXITSTACK_CONDITION_MATCHES( item->condition, condition ) || !( item->condition & CEXITSTACK_CONDITION_INDEPENDENT )
+            || item->condition & CEXITSTACK_CONDITION_ARGS) {
+            i = cexitstack_item_pop( stack->items, i, condition );
+            continue;
+        }
+        unsigned int begin = i - 1;
+        while (begin > 0) {
+            item = stack->items + begin - 1;
+            if (item->condition & CEXITSTACK_CONDITION_ARGS) break;
+            if (CEXITSTACK_CONDITION_MATCHES( item->condition, condition ) && !( item->condition & CEXITSTACK_CONDITION_INDEPENDENT ))
+                break;
+            begin--;
+        }
+        cexitstack_pool_run( pool, stack->items, begin, i, condition );
+        i = begin;
+    }
+    cexitstack_free( stack );
+    return return_val;
+}
+
+static void
+cexitstack_pool_run( cexitstack_pool *pool, const cexitstack_item *items, unsigned int begin, unsigned int end, unsigned int condition )
+{
+    if (!pool || !pool->threads || end - begin < CEXITSTACK_POOL_MIN_BATCH) {
+        while (end-- > begin)
+            if (CEXITSTACK_CONDITION_MATCHES( items[end].condition, condition ))
+                ( *items[end].func )( items[end].object );
+        return;
+    }
+    mtx_lock( &pool->run_lock );
+    unsigned int participants = pool->threads + 1;
+    unsigned int share = ( end - begin ) / participants;
+    for (unsigned int p = 0; p < participants; p++) {
+        uint64_t range_begin = begin + (uint64_t)share * p;
+        uint64_t range_end = p + 1 == participants ? end : range_begin + share;
+        atomic_store_explicit( pool->ranges + p, range_begin << 32 | range_end, memory_order_relaxed );
+    }
+    pool->items = items;
+    pool->condition = condition;
+    mtx_lock( &pool->lock );
+    pool->generation++;
+    pool->busy = pool->threads;
+    cnd_broadcast( &pool->wake );
+    mtx_unlock( &pool->lock );
+    cexitstack_pool_work( pool, pool->threads );
+    mtx_lock( &pool->lock );
+    while (pool->busy)
+        cnd_wait( &pool->done, &pool->lock );
+    mtx_unlock( &pool->lock );
+    mtx_unlock( &pool->run_lock );
+}
+
+static int
+cexitstack_pool_worker( void *arg )
+{
+    cexitstack_pool_worker_args args = *(cexitstack_pool_worker_args *)arg;
+    free( arg );
+    cexitstack_pool *pool = args.pool;
+    unsigned long long seen = 0;
+    for (;;) {
+        mtx_lock( &pool->lock );
+        while (!pool->stopping && pool->generation == seen)
+            cnd_wait( &pool->wake, &pool->lock );
+        if (pool->stopping) {
+            mtx_unlock( &pool->lock );
+            return 0;
+        }
+        seen = pool->generation;
+        mtx_unlock( &pool->lock );
+        cexitstack_pool_work( pool, args.index );
+        mtx_lock( &pool->lock );
+        if (--pool->busy == 0)
+            cnd_signal( &pool->done );
+        mtx_unlock( &pool->lock );
+    }
+}
+
+static void
+cexitstack_pool_work( cexitstack_pool *pool, unsigned int self )
+{
+    unsigned int participants = pool->threads + 1;
+    _Atomic uint64_t *own = pool->ranges + self;
+    for (;;) {
+        uint64_t range = atomic_load_explicit( own, memory_order_acquire );
+        while (( range >> 32 ) < ( range & 0xFFFFFFFFu )) {
+            if (atomic_compare_exchange_weak_explicit( own, &range, range - 1, memory_order_acq_rel, memory_order_acquire )) {
+                const cexitstack_item *item = pool->items + ( range & 0xFFFFFFFFu ) - 1;
+                if (CEXITSTACK_CONDITION_MATCHES( item->condition, pool->condition ))
+                    ( *item->func )( item->object );
+                range = atomic_load_explicit( own, memory_order_acquire );
+            }
+        }
+        int stolen = 0;
+        for (unsigned int k = 1; k < participants && !stolen; k++) {
+            _Atomic uint64_t *victim = pool->ranges + ( self + k ) % participants;
+            uint64_t victim_range = atomic_load_explicit( victim, memory_order_acquire );
+            for (;;) {
+                uint64_t victim_begin = victim_range >> 32, victim_end = victim_range & 0xFFFFFFFFu;
+                if (victim_begin >= victim_end) break;
+                uint64_t taken = ( victim_end - victim_begin + 1 ) / 2;
+                if (atomic_compare_exchange_weak_explicit( victim, &victim_range, ( victim_begin + taken ) << 32 | victim_end,
+                                                           memory_order_acq_rel, memory_order_acquire )) {
+                    atomic_store_explicit( own, victim_begin << 32 | ( victim_begin + taken ), memory_order_release );
+                    stolen = 1;
+                    break;
+                }
+            }
+        }
+        if (!stolen) return;
+    }
+}
@@ -0,0 +1,15 @@
+#pragma once
+#ifndef CEXITSTACK_POOL_H
+#define CEXITSTACK_POOL_H
+
+#include "cexitstack.h"
+
+#define CEXITSTACK_POOL_MIN_BATCH 16
+
+typedef struct _cexitstack_pool cexitstack_pool;
+
+extern inline cexitstack_pool *cexitstack_pool_new( unsigned int threads );
+extern inline void cexitstack_pool_free( cexitstack_pool *pool );
+extern inline int cexitstack_return_parallel( cexitstack *stack, int return_val, unsigned int condition, cexitstack_pool *pool );
+
+#endif
@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include "cexitstack_reclaim.h"
+
+// A single background thread runs the queued cleanups in the order they were queued, so the items
+// of one stack still run in LIFO order. The queue is a ring of item copies; a producer that finds
+// it full waits for room, which bounds the memory held by cleanups not yet run.
+struct _cexitstack_reclaimer
+{
+    thrd_t thread;
+    mtx_t lock;
+    cnd_t not_empty;
+    cnd_t not_full;
+    cnd_t idle;
+    cexitstack_item *queue;
+    unsigned int capacity;
+    unsigned int head;
+    unsigned int count;
+    unsigned int running;
+    int stopping;
+    cexitstack_reclaimer_stats stats;
+};
+
+static int cexitstack_reclaimer_thread( void *arg );
+
+inline cexitstack_reclaimer *
+cexitstack_reclaimer_new( unsigned int capacity )
+{
+    cexitstack_reclaimer *reclaimer = calloc( 1, sizeof( cexitstack_reclaimer ) );
+    if (!reclaimer) return NULL;
+    // room for at least one args item (two slots)
+    reclaimer->capacity = capacity ? capacity < 2 ? 2 : capacity : CEXITSTACK_RECLAIM_DEFAULT_CAPACITY;
+    reclaimer->queue = malloc( reclaimer->capacity * sizeof( cexitstack_item ) );
+    if (!reclaimer->queue) goto error;
+    if (mtx_init( &reclaimer->lock, mtx_plain ) != thrd_success) goto error;
+    if (cnd_init( &reclaimer->not_empty ) != thrd_success) goto error_lock;
+    if (cnd_init( &reclaimer->not_full ) != thrd_success) goto error_not_empty;
+    if (cnd_init( &reclaimer->idle ) != thrd_success) goto error_not_full;
+    if (thrd_create( &reclaimer->thread, &cexitstack_reclaimer_thread, reclaimer ) != thrd_success) goto error_idle;
+    return reclaimer;
+error_idle:
+    cnd_destroy( &reclaimer->idle );
+error_not_full:
+    cnd_destroy( &reclaimer->not_full );
+error_not_empty:
+    cnd_destroy( &reclaimer->not_empty );
+error_lock:
+    mtx_destroy( &reclaimer->lock );
+error:
+    free( reclaimer->queue );
+    free( reclaimer );
+    return NULL;
+}
+
+// Like cexitstack_return, but the matching items are queued for the reclaimer thread instead of
+// being run here. Blocks only while the queue is full. Without a reclaimer, with uncommitted rollback
+// items, or when called from a cleanup running on the reclaimer thread itself, the items are run right away.
+inline int
+cexitstack_return_deferred( cexitstack *stack, int return_val, unsigned int condition, cexitstack_reclaimer *reclaimer )
+{
+    if (!reclaimer || stack->rollback_length || thrd_equal( thrd_current(), reclaimer->thread ))
+        return cexitstack_return( stack, return_val, condition );
+    unsigned int i = stack->items ? stack->length : 0;
+    while (i > 0 && !CEXITSTACK_CONDITION_MATCHES( stack->items[i - 1].condition, condition ))
+        i -= stack->items[i - 1].condition & CEXITSTACK_CONDITION_ARGS ? 2 : 1;
+    if (i > 0) {
+        mtx_lock( &reclaimer->lock );
+        while (i > 0) {
+            const cexitstack_item *item = stack->items + i - 1;
+            unsigned int slots = item->condition & CEXITSTACK_CONDITION_ARGS ? 2 : 1;
+            i -= slots;
+            if (!CEXITSTACK_CONDITION_MATCHES( item->condition, condition )) continue;
+            if (reclaimer->capacity - reclaimer->count < slots) {
+                reclaimer->stats.producer_waits++;
+                while (reclaimer->capacity - reclaimer->count < slots)
+                    cnd_wait( &reclaimer->not_full, &reclaimer->lock );
+            }
+            if (!reclaimer->count) cnd_signal( &reclaimer->not_empty );
+            // an args item is queued above its args, so the reclaimer meets it first
+            reclaimer->queue[( reclaimer->head + reclaimer->count++ ) % reclaimer->capacity] = item[0];
+            if (slots == 2)
+                reclaimer->queue[( reclaimer->head + reclaimer->count++ ) % reclaimer->capacity] = item[-1];
+            reclaimer->stats.queued++;
+        }
+        mtx_unlock( &reclaimer->lock );
+    }
+    cexitstack_free( stack );
+    return return_val;
+}
+
+// waits until every cleanup queued so far has run
+inline void
+cexitstack_reclaimer_flush( cexitstack_reclaimer *reclaimer )
+{
+    if (!reclaimer) return;
+    mtx_lock( &reclaimer->lock );
+    while (reclaimer->count || reclaimer->running)
+        cnd_wait( &reclaimer->idle, &reclaimer->lock );
+    mtx_unlock( &reclaimer->lock );
+}
+
+inline void
+cexitstack_reclaimer_stats_get( cexitstack_reclaimer *reclaimer, cexitstack_reclaimer_stats *stats )
+{
+    mtx_lock( &reclaimer->lock );
+    *stats = reclaimer->stats;
+    mtx_unlock( &reclaimer->lock );
+}
+
+// runs the remaining queued cleanups, then stops the reclaimer thread
+inline void
+cexitstack_reclaimer_free( cexitstack_reclaimer *reclaimer )
+{
+    if (!reclaimer) return;
+    mtx_lock( &reclaimer->lock );
+    reclaimer->stopping = 1;
+    cnd_signal( &reclaimer->not_empty );
+    mtx_unlock( &reclaimer->lock );
+    thrd_join( reclaimer->thread, NULL );
+    cnd_destroy( &reclaimer->idle );
+    cnd_destroy( &reclaimer->not_full );
+    cnd_destroy( &reclaimer->not_empty );
+    mtx_destroy( &reclaimer->lock );
+    free( reclaimer->queue );
+    free( reclaimer );
+}
+
+static int
+cexitstack_reclaimer_thread( void *arg )
+{
+    cexitstack_reclaimer *reclaimer = arg;
+    cexitstack_item batch[CEXITSTACK_RECLAIM_BATCH + 1];
+    mtx_lock( &reclaimer->lock );
+    for (;;) {
+        while (!reclaimer->count && !reclaimer->stopping)
+            cnd_wait( &reclaimer->not_empty, &reclaimer->lock );
+        if (!reclaimer->count) break;
+        // an args item is queued right above its args and taken together with them, so the args
+        // slot is never read as an item
+        unsigned int taken = 0;
+        while (reclaimer->count && taken < CEXITSTACK_RECLAIM_BATCH) {
+            int has_args = reclaimer->queue[reclaimer->head].condition & CEXITSTACK_CONDITION_ARGS ? 1 : 0;
+            for (int slot = 0; slot <= has_args; slot++) {
+                batch[taken++] = reclaimer->queue[reclaimer->head];
+                reclaimer->head = ( reclaimer->head + 1 ) % reclaimer->capacity;
+                reclaimer->count--;
+            }
+        }
+        reclaimer->running = taken;
+        cnd_broadcast( &reclaimer->not_full );
+        mtx_unlock( &reclaimer->lock );
+        unsigned int completed = 0;
+        for (unsigned int i = 0; i < taken; i++, completed++) {
+            if (batch[i].condition & CEXITSTACK_CONDITION_ARGS) {
+                cexitstack_args args;
+                memcpy( &args, batch + ++i, sizeof( cexitstack_args ) );
+                ( *(cexitstack_args_func *)batch[i - 1].func )( &args );
+            }
+            else {
+                ( *batch[i].func )( batch[i].object );
+            }
+        }
+        mtx_lock( &reclaimer->lock );
+        reclaimer->running = 0;
+        reclaimer->stats.completed += completed;
+        if (!reclaimer->count)
+            cnd_broadcast( &reclaimer->idle );
+    }
+    mtx_unlock( &reclaimer->lock );
+    return 0;
+}
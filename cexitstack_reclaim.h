@@ -0,0 +1,25 @@
+#pragma once
+#ifndef CEXITSTACK_RECLAIM_H
+#define CEXITSTACK_RECLAIM_H
+
+#include "cexitstack.h"
+
+#define CEXITSTACK_RECLAIM_DEFAULT_CAPACITY 4096
+#define CEXITSTACK_RECLAIM_BATCH 64
+
+typedef struct _cexitstack_reclaimer cexitstack_reclaimer;
+
+typedef struct _cexitstack_reclaimer_stats
+{
+    unsigned long long queued;
+    unsigned long long completed;
+    unsigned long long producer_waits;
+} cexitstack_reclaimer_stats;
+
+extern inline cexitstack_reclaimer *cexitstack_reclaimer_new( unsigned int capacity );
+extern inline int cexitstack_return_deferred( cexitstack *stack, int return_val, unsigned int condition, cexitstack_reclaimer *reclaimer );
+extern inline void cexitstack_reclaimer_flush( cexitstack_reclaimer *reclaimer );
+extern inline void cexitstack_reclaimer_stats_get( cexitstack_reclaimer *reclaimer, cexitstack_reclaimer_stats *stats );
+extern inline void cexitstack_reclaimer_free( cexitstack_reclaimer *reclaimer );
+
+#endif
@@ -0,0 +1,251 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "cexitstack_stats.h"
+
+#ifdef CEXITSTACK_STATS
+// Every thread records into its own block, so recording never contends. Counters are atomics read
+// and written with relaxed plain loads/stores by the owning thread only (no locked instructions);
+// readers sum all blocks. Blocks are linked into a global list and never freed, so the counts of
+// exited threads stay in the totals.
+typedef struct _cexitstack_stats_func_block
+{
+    _Atomic uintptr_t func;
+    _Atomic unsigned long long calls;
+    _Atomic unsigned long long total_ns;
+    _Atomic unsigned long long histogram[CEXITSTACK_STATS_BUCKETS];
+} cexitstack_stats_func_block;
+
+typedef struct _cexitstack_stats_block
+{
+    struct _cexitstack_stats_block *next;
+    _Atomic unsigned long long pushes;
+    _Atomic unsigned long long peak_depth;
+    _Atomic unsigned long long expands;
+    _Atomic unsigned long long bytes_copied;
+    _Atomic unsigned long long executed[CEXITSTACK_STATS_CONDITIONS];
+    _Atomic unsigned long long skipped[CEXITSTACK_STATS_CONDITIONS];
+    _Atomic unsigned long long other_calls;
+    // open addressing on the function pointer
+    cexitstack_stats_func_block funcs[CEXITSTACK_STATS_MAX_FUNCS];
+} cexitstack_stats_block;
+
+static _Atomic( cexitstack_stats_block * ) cexitstack_stats_blocks;
+static _Thread_local cexitstack_stats_block *cexitstack_stats_thread_block;
+
+#define CEXITSTACK_STATS_LOAD(counter) atomic_load_explicit( &(counter), memory_order_relaxed )
+#define CEXITSTACK_STATS_ADD(counter, n) \
+    atomic_store_explicit( &(counter), atomic_load_explicit( &(counter), memory_order_relaxed ) + (n), memory_order_relaxed )
+
+static cexitstack_stats_block *cexitstack_stats_block_get( void );
+static unsigned int cexitstack_stats_condition_index( unsigned int condition );
+static unsigned int cexitstack_stats_bucket( unsigned long long ns );
+#endif
+
+inline void
+cexitstack_stats_get( cexitstack_stats *stats )
+{
+    memset( stats, 0, sizeof( cexitstack_stats ) );
+#ifdef CEXITSTACK_STATS
+    for (cexitstack_stats_block *block = atomic_load( &cexitstack_stats_blocks ); block; block = block->next) {
+        stats->pushes += CEXITSTACK_STATS_LOAD( block->pushes );
+        unsigned long long peak_depth = CEXITSTACK_STATS_LOAD( block->peak_depth );
+        if (peak_depth > stats->peak_depth) stats->peak_depth = peak_depth;
+        stats->expands += CEXITSTACK_STATS_LOAD( block->expands );
+        stats->bytes_copied += CEXITSTACK_STATS_LOAD( block->bytes_copied );
+        for (unsigned int i = 0; i < CEXITSTACK_STATS_CONDITIONS; i++) {
+            stats->executed[i] += CEXITSTACK_STATS_LOAD( block->executed[i] );
+            stats->skipped[i] += CEXITSTACK_STATS_LOAD( block->skipped[i] );
+        }
+        stats->other_calls += CEXITSTACK_STATS_LOAD( block->other_calls );
+        for (unsigned int f = 0; f < CEXITSTACK_STATS_MAX_FUNCS; f++) {
+            cexitstack_stats_func_block *entry = block->funcs + f;
+            uintptr_t func = atomic_load_explicit( &entry->func, memory_order_acquire );
+            if (!func) continue;
+            unsigned int j = 0;
+            while (j < stats->func_count && (uintptr_t)stats->funcs[j].func != func)
+                j++;
+            if (j == CEXITSTACK_STATS_MAX_FUNCS) {
+                stats->other_calls += CEXITSTACK_STATS_LOAD( entry->calls );
+                continue;
+            }
+            if (j == stats->func_count)
+                stats->funcs[stats->func_count++].func = (cexitstack_func *)func;
+            stats->funcs[j].calls += CEXITSTACK_STATS_LOAD( entry->calls );
+            stats->funcs[j].total_ns += CEXITSTACK_STATS_LOAD( entry->total_ns );
+            for (unsigned int b = 0; b < CEXITSTACK_STATS_BUCKETS; b++)
+                stats->funcs[j].histogram[b] += CEXITSTACK_STATS_LOAD( entry->histogram[b] );
+        }
+    }
+#endif
+}
+
+// writes the totals as one JSON object; functions are identified by address
+inline int
+cexitstack_stats_dump( FILE *out )
+{
+    cexitstack_stats *stats = malloc( sizeof( cexitstack_stats ) );
+    if (!stats) return 0;
+    cexitstack_stats_get( stats );
+    fprintf( out, "{\"pushes\":%llu,\"peak_depth\":%llu,\"expands\":%llu,\"bytes_copied\":%llu,", stats->pushes, stats->peak_depth,
+             stats->expands, stats->bytes_copied );
+    const char *names[] = { "executed", "skipped" };
+    for (int k = 0; k < 2; k++) {
+        unsigned long long *counts = k ? stats->skipped : stats->executed;
+        fprintf( out, "\"%s\":{", names[k] );
+        int first = 1;
+        for (unsigned int i = 0; i < CEXITSTACK_STATS_CONDITIONS; i++) {
+            if (!counts[i]) continue;
+            if (i) fprintf( out, "%s\"0x%x\":%llu", first ? "" : ",", 1u << ( i - 1 ), counts[i] );
+            else fprintf( out, "%s\"always\":%llu", first ? "" : ",", counts[i] );
+            first = 0;
+        }
+        fprintf( out, "}," );
+    }
+    fprintf( out, "\"other_calls\":%llu,\"funcs\":[", stats->other_calls );
+    for (unsigned int f = 0; f < stats->func_count; f++) {
+        cexitstack_func_stats *entry = stats->funcs + f;
+        fprintf( out, "%s{\"func\":\"%p\",\"calls\":%llu,\"total_ns\":%llu,\"histogram\":[", f ? "," : "", (void *)(uintptr_t)entry->func,
+                 entry->calls, entry->total_ns );
+        unsigned int last = CEXITSTACK_STATS_BUCKETS;
+        while (last > 1 && !entry->histogram[last - 1])
+            last--;
+        for (unsigned int b = 0; b < last; b++)
+            fprintf( out, "%s%llu", b ? "," : "", entry->histogram[b] );
+        fprintf( out, "]}" );
+    }
+    int ok = fprintf( out, "]}\n" ) > 0;
+    free( stats );
+    return ok;
+}
+
+// zeroes all counters; counts recorded by other threads at the same time may be lost
+inline void
+cexitstack_stats_reset( void )
+{
+#ifdef CEXITSTACK_STATS
+    for (cexitstack_stats_block *block = atomic_load( &cexitstack_stats_blocks ); block; block = block->next) {
+        atomic_store_explicit( &block->pushes, 0, memory_order_relaxed );
+        atomic_store_explicit( &block->peak_depth, 0, memory_order_relaxed );
+        atomic_store_explicit( &block->expands, 0, memory_order_relaxed );
+        atomic_store_explicit( &block->bytes_copied, 0, memory_order_relaxed );
+        for (unsigned int i = 0; i < CEXITSTACK_STATS_CONDITIONS; i++) {
+            atomic_store_explicit( block->executed + i, 0, memory_order_relaxed );
+            atomic_store_explicit( block->skipped + i, 0, memory_order_relaxed );
+        }
+        atomic_store_explicit( &block->other_calls, 0, memory_order_relaxed );
+        for (unsigned int f = 0; f < CEXITSTACK_STATS_MAX_FUNCS; f++) {
+            atomic_store_explicit( &block->funcs[f].calls, 0, memory_order_relaxed );
+            atomic_store_explicit( &block->funcs[f].total_ns, 0, memory_order_relaxed );
+            for (unsigned int b = 0; b < CEXITSTACK_STATS_BUCKETS; b++)
+                atomic_store_explicit( block->funcs[f].histogram + b, 0, memory_order_relaxed );
+        }
+    }
+#endif
+}
+
+#ifdef CEXITSTACK_STATS
+inline unsigned long long
+cexitstack_stats_now( void )
+{
+    struct timespec now;
+    timespec_get( &now, TIME_UTC );
+    return (unsigned long long)now.tv_sec * 1000000000ull + (unsigned long long)now.tv_nsec;
+}
+
+inline void
+cexitstack_stats_record_push( unsigned int count, unsigned int depth )
+{
+    cexitstack_stats_block *block = cexitstack_stats_block_get();
+    if (!block) return;
+    CEXITSTACK_STATS_ADD( block->pushes, count );
+    if (depth > CEXITSTACK_STATS_LOAD( block->peak_depth ))
+        atomic_store_explicit( &block->peak_depth, depth, memory_order_relaxed );
+}
+
+// bytes_copied is what a move of the array costs at most, realloc may grow in place
+inline void
+cexitstack_stats_record_expand( size_t bytes_copied )
+{
+    cexitstack_stats_block *block = cexitstack_stats_block_get();
+    if (!block) return;
+    CEXITSTACK_STATS_ADD( block->expands, 1 );
+    CEXITSTACK_STATS_ADD( block->bytes_copied, bytes_copied );
+}
+
+inline void
+cexitstack_stats_record_unwound( unsigned int condition, int executed )
+{
+    cexitstack_stats_block *block = cexitstack_stats_block_get();
+    if (!block) return;
+    unsigned int index = cexitstack_stats_condition_index( condition );
+    if (executed) CEXITSTACK_STATS_ADD( block->executed[index], 1 );
+    else CEXITSTACK_STATS_ADD( block->skipped[index], 1 );
+}
+
+// calls > 1 for batched calls (e.g. a run of frees): each gets the average time
+inline void
+cexitstack_stats_record_call( cexitstack_func *func, unsigned int calls, unsigned long long start )
+{
+    unsigned long long elapsed = cexitstack_stats_now() - start;
+    cexitstack_stats_block *block = cexitstack_stats_block_get();
+    if (!block || !calls) return;
+    uintptr_t key = (uintptr_t)func;
+    unsigned int slot = (unsigned int)( ( key >> 4 ) * 2654435761u ) % CEXITSTACK_STATS_MAX_FUNCS;
+    for (unsigned int probe = 0; probe < CEXITSTACK_STATS_MAX_FUNCS; probe++) {
+        cexitstack_stats_func_block *entry = block->funcs + ( slot + probe ) % CEXITSTACK_STATS_MAX_FUNCS;
+        uintptr_t entry_func = atomic_load_explicit( &entry->func, memory_order_relaxed );
+        if (!entry_func) {
+            atomic_store_explicit( &entry->func, key, memory_order_release );
+            entry_func = key;
+        }
+        if (entry_func != key) continue;
+        CEXITSTACK_STATS_ADD( entry->calls, calls );
+        CEXITSTACK_STATS_ADD( entry->total_ns, elapsed );
+        CEXITSTACK_STATS_ADD( entry->histogram[cexitstack_stats_bucket( elapsed / calls )], calls );
+        return;
+    }
+    CEXITSTACK_STATS_ADD( block->other_calls, calls );
+}
+
+static cexitstack_stats_block *
+cexitstack_stats_block_get( void )
+{
+    cexitstack_stats_block *block = cexitstack_stats_thread_block;
+    if (block) return block;
+    block = calloc( 1, sizeof( cexitstack_stats_block ) );
+    if (!block) return NULL;
+    block->next = atomic_load( &cexitstack_stats_blocks );
+    while (!atomic_compare_exchange_weak( &cexitstack_stats_blocks, &block->next, block ))
+        ;
+    cexitstack_stats_thread_block = block;
+    return block;
+}
+
+static unsigned int
+cexitstack_stats_condition_index( unsigned int condition )
+{
+    condition &= ~CEXITSTACK_CONDITION_FLAGS;
+    if (condition == CEXITSTACK_CONDITION_ALWAYS) return 0;
+    unsigned int index = 1;
+    while (!( condition & 1 )) {
+        condition >>= 1;
+        index++;
+    }
+    return index;
+}
+
+static unsigned int
+cexitstack_stats_bucket( unsigned long long ns )
+{
+    unsigned int bucket = 0;
+    while (ns > 1 && bucket < CEXITSTACK_STATS_BUCKETS - 1) {
+        ns >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+#endif
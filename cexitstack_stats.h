@@ -0,0 +1,69 @@
+#pragma once
+#ifndef CEXITSTACK_STATS_H
+#define CEXITSTACK_STATS_H
+
+#include <stdio.h>
+
+#include "cexitstack.h"
+
+// Counters for cexitstack and gexitstack, compiled in only when CEXITSTACK_STATS is defined
+// (for the library and everything including this header). Without it the recording macros expand
+// to nothing and cexitstack_stats_get reports zeros.
+
+#define CEXITSTACK_STATS_MAX_FUNCS 64
+#define CEXITSTACK_STATS_BUCKETS 32
+// executed/skipped index: 0 for CEXITSTACK_CONDITION_ALWAYS items, else 1 + the lowest condition bit
+#define CEXITSTACK_STATS_CONDITIONS 33
+
+typedef struct _cexitstack_func_stats
+{
+    cexitstack_func *func;
+    unsigned long long calls;
+    unsigned long long total_ns;
+    // histogram[i]: calls that took [2^i, 2^(i+1)) ns, bucket 0 also holds 0 ns
+    unsigned long long histogram[CEXITSTACK_STATS_BUCKETS];
+} cexitstack_func_stats;
+
+typedef struct _cexitstack_stats
+{
+    unsigned long long pushes;
+    unsigned long long peak_depth;
+    unsigned long long expands;
+    unsigned long long bytes_copied;
+    unsigned long long executed[CEXITSTACK_STATS_CONDITIONS];
+    unsigned long long skipped[CEXITSTACK_STATS_CONDITIONS];
+    unsigned int func_count;
+    // calls of functions that didn't fit into funcs
+    unsigned long long other_calls;
+    cexitstack_func_stats funcs[CEXITSTACK_STATS_MAX_FUNCS];
+} cexitstack_stats;
+
+extern inline void cexitstack_stats_get( cexitstack_stats *stats );
+extern inline int cexitstack_stats_dump( FILE *out );
+extern inline void cexitstack_stats_reset( void );
+
+#ifdef CEXITSTACK_STATS
+extern inline unsigned long long cexitstack_stats_now( void );
+extern inline void cexitstack_stats_record_push( unsigned int count, unsigned int depth );
+extern inline void cexitstack_stats_record_expand( size_t bytes_copied );
+extern inline void cexitstack_stats_record_unwound( unsigned int condition, int executed );
+extern inline void cexitstack_stats_record_call( cexitstack_func *func, unsigned int calls, unsigned long long start );
+
+#define CEXITSTACK_STATS_PUSH(count, depth) cexitstack_stats_record_push( (count), (depth) )
+#define CEXITSTACK_STATS_EXPAND(bytes_copied) cexitstack_stats_record_expand( (bytes_copied) )
+#define CEXITSTACK_STATS_UNWOUND(condition, executed) cexitstack_stats_record_unwound( (condition), (executed) )
+#define CEXITSTACK_STATS_TIMER(name) unsigned long long name = cexitstack_stats_now()
+#define CEXITSTACK_STATS_CALLED(func, calls, timer) cexitstack_stats_record_call( (cexitstack_func *)(func), (calls), (timer) )
+#else
+#define CEXITSTACK_STATS_PUSH(count, depth)
+#define CEXITSTACK_STATS_EXPAND(bytes_copied)
+#define CEXITSTACK_STATS_UNWOUND(condition, executed)
+#define CEXITSTACK_STATS_TIMER(name)
+#define CEXITSTACK_STATS_CALLED(func, calls, timer) ( (void)(func), (void)(calls) )
+#endif
+
+#if defined(CEXITSTACK_HEADER_ONLY) && !defined(CEXITSTACK_C)
+#include "cexitstack.c"
+#endif
+
+#endif
@@ -1,52 +1,151 @@
+#include <string.h>
+
 #include <glib.h>
 
 #include "gexitstack.h"
+#include "cexitstack_stats.h"
+
+// the struct and its inline items are one GSlice block
+#define GEXITSTACK_BLOCK_SIZE ( sizeof( gexitstack ) + sizeof( gexitstack_item ) * GEXITSTACK_DEFAULT_INITIAL_CAPACITY )
 
-static void gexitstack_item_destroy( gexitstack_item *const item );
+static void gexitstack_grow( gexitstack *stack, const guint needed );
+static void gexitstack_release( gexitstack *stack );
+static void gexitstack_unwind( gexitstack *stack, const guint mark, const guint condition );
 
 inline gexitstack *
 gexitstack_new( void )
 {
-    GArray *stack = g_array_sized_new( FALSE, TRUE, sizeof( gexitstack_item ), GEXITSTACK_DEFAULT_INITIAL_CAPACITY );
-    //g_array_set_clear_func( stack, NULL );
+    gexitstack *stack = g_slice_alloc( GEXITSTACK_BLOCK_SIZE );
+    stack->data = stack->inline_items;
+    stack->len = 0;
+    stack->capacity = GEXITSTACK_DEFAULT_INITIAL_CAPACITY;
     return stack;
 }
 
 inline int
 gexitstack_return( gexitstack *stack, const gint return_val, const guint condition )
 {
-    for (guint i = stack->len; i > 0; i--) {
-        gexitstack_item *item = &g_array_index( stack, gexitstack_item, i - 1 );
-        if (item->condition == GEXITSTACK_CONDITION_ALWAYS || condition & item->condition)
-            gexitstack_item_destroy( item );
-    }
-    g_array_unref( stack );
+    gexitstack_unwind( stack, 0, condition );
+    gexitstack_release( stack );
     return return_val;
 }
 
+inline guint
+gexitstack_mark( const gexitstack *stack )
+{
+    return stack->len;
+}
+
+inline int
+gexitstack_unwind_to( gexitstack *stack, const guint mark, const guint condition )
+{
+    if (mark > stack->len) return 0;
+    gexitstack_unwind( stack, mark, condition );
+    return 1;
+}
+
 inline gexitstack *
 gexitstack_push_full( gexitstack *stack, const gpointer object, guint condition, const GDestroyNotify func )
 {
-    const gexitstack_item new_item = ( gexitstack_item ){ .object = object, .condition = condition, .func = func };
-    return g_array_append_vals( stack, &new_item, 1 );
+    if (G_UNLIKELY( stack->len == stack->capacity ))
+        gexitstack_grow( stack, stack->len + 1 );
+    gexitstack_item *item = &stack->data[stack->len++];
+    item->object = object;
+    item->condition = condition;
+    item->func = func;
+    CEXITSTACK_STATS_PUSH( 1, stack->len );
+    return stack;
 }
 
 inline gexitstack *
 gexitstack_push_struct( gexitstack *stack, const gexitstack_item *item )
 {
-    return g_array_append_vals( stack, item, 1 );
+    return gexitstack_push_full( stack, item->object, item->condition, item->func );
+}
+
+inline gexitstack *
+gexitstack_push_many( gexitstack *stack, const gpointer *objects, guint count, guint condition, const GDestroyNotify func )
+{
+    if (!count) return stack;
+    g_return_val_if_fail( count <= G_MAXUINT - stack->len, stack );
+    if (stack->len + count > stack->capacity)
+        gexitstack_grow( stack, stack->len + count );
+    gexitstack_item *items = stack->data + stack->len;
+    for (guint i = 0; i < count; i++)
+        items[i] = ( gexitstack_item ){ .object = objects[i], .condition = condition, .func = func };
+    stack->len += count;
+    CEXITSTACK_STATS_PUSH( count, stack->len );
+    return stack;
 }
 
 inline void
 gexitstack_free( gexitstack **stack )
 {
-    g_clear_pointer( stack, g_array_unref );
+    g_clear_pointer( stack, gexitstack_release );
+}
+
+// doubles the capacity until needed items fit; like the rest of GLib, aborts when out of memory
+G_GNUC_NO_INLINE static void
+gexitstack_grow( gexitstack *stack, const guint needed )
+{
+    guint capacity = stack->capacity;
+    while (capacity < needed)
+        capacity = capacity > G_MAXUINT / 2 ? needed : capacity * 2;
+    if (stack->data == stack->inline_items) {
+        stack->data = g_new( gexitstack_item, capacity );
+        memcpy( stack->data, stack->inline_items, sizeof( gexitstack_item ) * stack->len );
+    }
+    else {
+        stack->data = g_renew( gexitstack_item, stack->data, capacity );
+    }
+    CEXITSTACK_STATS_EXPAND( sizeof( gexitstack_item ) * stack->len );
+    stack->capacity = capacity;
 }
 
 static void
-gexitstack_item_destroy( gexitstack_item *const item )
+gexitstack_release( gexitstack *stack )
 {
-    g_clear_pointer( &item->object, item->func );
-    item->condition = 0;
-    item->func = NULL;
-}
\ No newline at end of file
+    if (stack->data != stack->inline_items)
+        g_free( stack->data );
+    g_slice_free1( GEXITSTACK_BLOCK_SIZE, stack );
+}
+
+// runs the matching items above mark, from the top down; each item is popped before its cleanup
+// runs, so a cleanup sees the stack as it is without it
+static void
+gexitstack_unwind( gexitstack *stack, const guint mark, const guint condition )
+{
+    while (stack->len > mark) {
+        const gexitstack_item item = stack->data[--stack->len];
+        if (item.condition != GEXITSTACK_CONDITION_ALWAYS && !( condition & item.condition )) {
+            CEXITSTACK_STATS_UNWOUND( item.condition, 0 );
+            continue;
+        }
+        CEXITSTACK_STATS_UNWOUND( item.condition, 1 );
+        CEXITSTACK_STATS_TIMER( start );
+        if (item.func != g_free) {
+            // NULL objects are skipped, as g_clear_pointer does
+            if (item.object)
+                item.func( item.object );
+            CEXITSTACK_STATS_CALLED( item.func, 1, start );
+            continue;
+        }
+        // plain buffers: free the run of matching g_free items below with direct calls
+        g_free( item.object );
+        guint freed = 1;
+        while (stack->len > mark) {
+            const gexitstack_item *next = &stack->data[stack->len - 1];
+            if (next->condition == GEXITSTACK_CONDITION_ALWAYS || condition & next->condition) {
+                if (next->func != g_free) break;
+                g_free( next->object );
+                freed++;
+                CEXITSTACK_STATS_UNWOUND( next->condition, 1 );
+            }
+            else {
+                CEXITSTACK_STATS_UNWOUND( next->condition, 0 );
+            }
+            stack->len--;
+        }
+        CEXITSTACK_STATS_CALLED( g_free, freed, start );
+    }
+}
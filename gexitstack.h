@@ -15,12 +15,22 @@ typedef struct _gexitstack_item
     GDestroyNotify func;
 } gexitstack_item;
 
-typedef GArray gexitstack;
+// data points at inline_items, allocated with the struct, until the stack outgrows them
+typedef struct _gexitstack
+{
+    gexitstack_item *data;
+    guint len;
+    guint capacity;
+    gexitstack_item inline_items[];
+} gexitstack;
 
 extern inline gexitstack *gexitstack_new( void );
 extern inline int gexitstack_return( gexitstack *stack, const gint return_val, const guint condition );
+extern inline guint gexitstack_mark( const gexitstack *stack );
+extern inline int gexitstack_unwind_to( gexitstack *stack, const guint mark, const guint condition );
 extern inline gexitstack *gexitstack_push_full( gexitstack *stack, const gpointer object, guint condition, const GDestroyNotify func );
 extern inline gexitstack *gexitstack_push_struct( gexitstack *stack, const gexitstack_item *item );
+extern inline gexitstack *gexitstack_push_many( gexitstack *stack, const gpointer *objects, guint count, guint condition, const GDestroyNotify func );
 extern inline void gexitstack_free( gexitstack **stack );
 
 #define gexitstack_push(X, Y, ...) _Generic((Y), \
@@ -1,9 +1,35 @@
+#ifdef __linux__
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <ucontext.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#endif
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
+#include <threads.h>
+#include <stdatomic.h>
+#ifndef CEXITSTACK_NO_GLIB
 #include <glib.h>
+#endif
 
 #include "cexitstack.h"
+#ifndef CEXITSTACK_NO_GLIB
 #include "gexitstack.h"
+#endif
+#include "cexitstack_compact.h"
+#include "cexitstack_concurrent.h"
+#include "cexitstack_pool.h"
+#include "cexitstack_reclaim.h"
+#include "cexitstack_stats.h"
+#include "cexitstack_persist.h"
+#include "cexitstack_debug.h"
 
 void test_new_default( void )
 {
@@ -99,7 +125,7 @@ void test_push_multiple_struct( void )
     }
     assert( stack.length == TEST_PUSH_MULTIPLE_N );
     for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++)
-        assert( stack.items[i].condition == i && stack.items[i].func == &cexitstack_func_free && *(int *)stack.items[i].object == objects[i] );
+        assert( stack.items[i].condition == (unsigned int)i && stack.items[i].func == &cexitstack_func_free && *(int *)stack.items[i].object == objects[i] );
     free( stack.items );
 }
 
@@ -112,7 +138,7 @@ void test_push_multiple_full( void )
         cexitstack_push_full( &stack, objects + i, i, &cexitstack_func_free );
     assert( stack.length == TEST_PUSH_MULTIPLE_N );
     for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++)
-        assert( stack.items[i].condition == i && stack.items[i].func == &cexitstack_func_free && *(int *)stack.items[i].object == objects[i] );
+        assert( stack.items[i].condition == (unsigned int)i && stack.items[i].func == &cexitstack_func_free && *(int *)stack.items[i].object == objects[i] );
     free( stack.items );
 }
 
@@ -128,16 +154,124 @@ void test_realloc( void )
     assert( stack.capacity > old_capacity );
     assert( stack.length == TEST_PUSH_MULTIPLE_N );
     for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++)
-        assert( stack.items[i].condition == i && stack.items[i].func == &cexitstack_func_free && *(int *)stack.items[i].object == objects[i] );
+        assert( stack.items[i].condition == (unsigned int)i && stack.items[i].func == &cexitstack_func_free && *(int *)stack.items[i].object == objects[i] );
     free( stack.items );
 }
 
+void test_growth_geometric( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, TEST_REALLOC_N ) != 0 );
+    assert( stack.growth == CEXITSTACK_GROWTH_GEOMETRIC );
+    int objects[TEST_PUSH_MULTIPLE_N] = { 10, 11, 12, 13, 14 };
+    for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++)
+        cexitstack_push_full( &stack, objects + i, i, &cexitstack_func_free );
+    assert( stack.capacity == TEST_REALLOC_N * 4 );
+    assert( stack.length == TEST_PUSH_MULTIPLE_N );
+    free( stack.items );
+}
+
+void test_growth_linear( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, TEST_REALLOC_N ) != 0 );
+    cexitstack_set_growth( &stack, 1 );
+    int objects[TEST_PUSH_MULTIPLE_N] = { 10, 11, 12, 13, 14 };
+    for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++)
+        cexitstack_push_full( &stack, objects + i, i, &cexitstack_func_free );
+    assert( stack.capacity == TEST_PUSH_MULTIPLE_N );
+    for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++)
+        assert( stack.items[i].condition == (unsigned int)i && *(int *)stack.items[i].object == objects[i] );
+    free( stack.items );
+}
+
+void test_reserve( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, TEST_REALLOC_N ) != 0 );
+    assert( cexitstack_reserve( &stack, 1 ) != 0 );
+    assert( stack.capacity == TEST_REALLOC_N );
+    assert( cexitstack_reserve( &stack, 1000 ) != 0 );
+    assert( stack.capacity == 1000 );
+    cexitstack_item *items = stack.items;
+    for (int i = 0; i < 1000; i++)
+        cexitstack_push_full( &stack, NULL, 0, &cexitstack_func_free );
+    assert( stack.items == items && stack.capacity == 1000 && stack.length == 1000 );
+    free( stack.items );
+}
+
+#define TEST_PUSH_MANY_N 100
+void test_push_many( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, TEST_REALLOC_N ) != 0 );
+    int objects[TEST_PUSH_MANY_N];
+    void *pointers[TEST_PUSH_MANY_N];
+    for (int i = 0; i < TEST_PUSH_MANY_N; i++) {
+        objects[i] = i;
+        pointers[i] = objects + i;
+    }
+    cexitstack_push_full( &stack, NULL, 0, &cexitstack_func_free );
+    assert( cexitstack_push_many( &stack, pointers, TEST_PUSH_MANY_N, 1, &cexitstack_func_free ) );
+    assert( cexitstack_push_many( &stack, NULL, 0, 1, &cexitstack_func_free ) );
+    assert( stack.length == TEST_PUSH_MANY_N + 1 );
+    assert( stack.capacity >= stack.length );
+    assert( stack.items[0].object == NULL );
+    for (int i = 0; i < TEST_PUSH_MANY_N; i++)
+        assert( stack.items[i + 1].condition == 1 && stack.items[i + 1].func == &cexitstack_func_free && *(int *)stack.items[i + 1].object == i );
+    free( stack.items );
+}
+
+#ifdef __linux__
+#define TEST_KIND_PIPES 4
+int test_macro_kinds_internal( int fd, void *buffer )
+{
+    CEXITSTACK( stack, 2 );
+    CEXITSTACK_PUSH_FREE( stack, buffer, CEXITSTACK_CONDITION_ALWAYS );
+    CEXITSTACK_PUSH_FD( stack, fd, CEXITSTACK_CONDITION_ERROR );
+    assert( CEXITSTACK_ITEM_KIND( stack.items[1].condition ) == CEXITSTACK_KIND_CLOSE );
+    CEXITSTACK_RETURN( stack, -1, CEXITSTACK_CONDITION_ERROR );
+}
+
+void test_push_kinds( void )
+{
+    int fds[2 * TEST_KIND_PIPES];
+    for (int i = 0; i < TEST_KIND_PIPES; i++)
+        assert( pipe( fds + 2 * i ) == 0 );
+    cexitstack stack;
+    assert( cexitstack_init( &stack, 0 ) );
+    // in the order they were opened, one of them not matching the unwind condition
+    for (int i = 0; i < 2 * TEST_KIND_PIPES; i++)
+        assert( cexitstack_push_fd( &stack, fds[i], i == 3 ? 2 : 1 ) );
+    assert( stack.items[0].object == (void *)(intptr_t)fds[0] );
+    FILE *file = tmpfile();
+    assert( file && cexitstack_push_file( &stack, file, CEXITSTACK_CONDITION_ALWAYS ) );
+    assert( cexitstack_push_free( &stack, malloc( 16 ), CEXITSTACK_CONDITION_ALWAYS ) );
+    size_t page = (size_t)sysconf( _SC_PAGESIZE );
+    void *mapping = mmap( NULL, page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    assert( mapping != MAP_FAILED );
+    assert( cexitstack_push_mapping( &stack, mapping, page, CEXITSTACK_CONDITION_ERROR ) );
+    assert( cexitstack_return( &stack, -1, 1 ) == -1 );
+    for (int i = 0; i < 2 * TEST_KIND_PIPES; i++)
+        assert( ( fcntl( fds[i], F_GETFD ) == -1 ) == ( i != 3 ) );
+    assert( msync( mapping, page, MS_ASYNC ) == -1 && errno == ENOMEM );
+
+    assert( pipe( fds ) == 0 );
+    assert( test_macro_kinds_internal( fds[0], malloc( 16 ) ) == -1 );
+    assert( fcntl( fds[0], F_GETFD ) == -1 );
+    close( fds[1] );
+    close( fds[3] );
+}
+#endif
+
 void test_faulty_input( void )
 {
     cexitstack stack = { .capacity = 0, .items = NULL };
     assert( cexitstack_init( NULL, 0 ) == 0 );
     assert( cexitstack_push_full( &stack, 0, 0, 0 ) == 0 );
     assert( cexitstack_push_struct( &stack, NULL ) == 0 );
+    assert( cexitstack_reserve( &stack, 10 ) == 0 );
+    assert( cexitstack_push_many( &stack, NULL, 1, 0, 0 ) == 0 );
 }
 
 void test_cexitstack_func_free( void )
@@ -152,6 +286,65 @@ void cexitstack_func_set( void *target )
     *(int *)target = 1;
 }
 
+static int test_args_log[16];
+static int test_args_log_length;
+
+static void test_args_record( cexitstack_args *args )
+{
+    assert( args->arg[1].size == 1000 + (size_t)args->arg[0].word );
+    test_args_log[test_args_log_length++] = (int)args->arg[0].word;
+}
+
+void test_push_args( void )
+{
+    int results[3] = { 0 };
+    cexitstack stack;
+    assert( cexitstack_init( &stack, 1 ) );
+    cexitstack_set_growth( &stack, 1 );
+    assert( cexitstack_push_full( &stack, malloc( 8 ), CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free ) );
+    assert( cexitstack_push_args( &stack, CEXITSTACK_ARGS( { .word = 1 }, { .size = 1001 } ), 2, &test_args_record ) );
+    // args that would look like a matching item (freeing a stack address) if they were read as one
+    cexitstack_push( &stack, CEXITSTACK_ARGS( { .pointer = results + 2 }, { .word = CEXITSTACK_CONDITION_ALWAYS },
+                                              { .pointer = (void *)(uintptr_t)&cexitstack_func_free } ), 4, &test_args_record )
+    assert( stack.length == 5 );
+    assert( cexitstack_push_full( &stack, malloc( 8 ), CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free ) );
+    unsigned int mark = cexitstack_mark( &stack );
+    assert( mark == 6 && stack.capacity >= 6 );
+    cexitstack_push( &stack, CEXITSTACK_ARGS( { .word = 3 }, { .size = 1003 } ), CEXITSTACK_CONDITION_ALWAYS, &test_args_record )
+    assert( cexitstack_push_full( &stack, results + 0, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    test_args_log_length = 0;
+    assert( cexitstack_unwind_to( &stack, mark, CEXITSTACK_CONDITION_ALWAYS ) );
+    assert( results[0] == 1 && test_args_log_length == 1 && test_args_log[0] == 3 );
+    assert( cexitstack_return( &stack, -1, 2 ) == -1 );
+    assert( test_args_log_length == 2 && test_args_log[1] == 1 );
+
+    cexitstack_pool *pool = cexitstack_pool_new( 2 );
+    cexitstack_reclaimer *reclaimer = cexitstack_reclaimer_new( 2 );
+    assert( pool && reclaimer );
+    for (int deferred = 0; deferred < 2; deferred++) {
+        cexitstack *heap_stack = cexitstack_new( 0 );
+        assert( heap_stack );
+        for (int i = 0; i < 3 * CEXITSTACK_POOL_MIN_BATCH; i++) {
+            if (i % CEXITSTACK_POOL_MIN_BATCH == 5)
+                assert( cexitstack_push_args( heap_stack, CEXITSTACK_ARGS( { .word = i }, { .size = 1000 + i } ), i / CEXITSTACK_POOL_MIN_BATCH == 1 ? 2 : 1, &test_args_record ) );
+            else
+                assert( cexitstack_push_full( heap_stack, malloc( 8 ), CEXITSTACK_CONDITION_INDEPENDENT, &cexitstack_func_free ) );
+        }
+        test_args_log_length = 0;
+        if (deferred) {
+            assert( cexitstack_return_deferred( heap_stack, 0, 1, reclaimer ) == 0 );
+            cexitstack_reclaimer_flush( reclaimer );
+        }
+        else {
+            assert( cexitstack_return_parallel( heap_stack, 0, 1, pool ) == 0 );
+        }
+        assert( test_args_log_length == 2 );
+        assert( test_args_log[0] == 2 * CEXITSTACK_POOL_MIN_BATCH + 5 && test_args_log[1] == 5 );
+    }
+    cexitstack_reclaimer_free( reclaimer );
+    cexitstack_pool_free( pool );
+}
+
 #define TEST_RETURN_SET_N 5
 void test_return_one_condition( void )
 {
@@ -200,6 +393,258 @@ void test_return_free_empty( void )
     assert( cexitstack_return( stack, -1, 0 ) == -1 );
 }
 
+static unsigned int test_batch_free_calls;
+static unsigned int test_batch_free_objects;
+
+static void test_batch_free( void **objects, unsigned int count )
+{
+    test_batch_free_calls++;
+    test_batch_free_objects += count;
+    for (unsigned int i = 0; i < count; i++)
+        free( objects[i] );
+}
+
+void test_return_batch_free( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, 0 ) != 0 );
+    int results[3] = { 0 };
+    cexitstack_push_full( &stack, results + 0, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set );
+    for (int i = 0; i < CEXITSTACK_BATCH_FREE_MAX + 10; i++)
+        cexitstack_push_full( &stack, malloc( 16 ), CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free );
+    cexitstack_push_full( &stack, results + 1, CEXITSTACK_CONDITION_ERROR, &cexitstack_func_set );
+    cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free );
+    cexitstack_push_full( &stack, results + 2, 2, &cexitstack_func_set );
+    cexitstack_push_full( &stack, malloc( 16 ), CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free );
+    cexitstack_set_batch_free( &test_batch_free );
+    assert( cexitstack_return( &stack, -1, CEXITSTACK_CONDITION_ERROR ) == -1 );
+    cexitstack_set_batch_free( NULL );
+    assert( results[0] == 1 && results[1] == 1 && results[2] == 0 );
+    assert( test_batch_free_objects == CEXITSTACK_BATCH_FREE_MAX + 11 );
+    assert( test_batch_free_calls == 3 );
+}
+
+// items pushed here and unwound by the library (which cexitstack_return_deferred without a reclaimer
+// calls) are the same cleanup with the same batch free hook, also when this file is header-only
+void test_return_batch_free_library( void )
+{
+    cexitstack *stack = cexitstack_new( 0 );
+    assert( stack );
+    for (int i = 0; i < 10; i++)
+        assert( cexitstack_push_full( stack, malloc( 16 ), CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free ) );
+    test_batch_free_calls = test_batch_free_objects = 0;
+    cexitstack_set_batch_free( &test_batch_free );
+    assert( cexitstack_return_deferred( stack, -1, CEXITSTACK_CONDITION_ERROR, NULL ) == -1 );
+    cexitstack_set_batch_free( NULL );
+    assert( test_batch_free_calls == 1 && test_batch_free_objects == 10 );
+}
+
+void test_mark_unwind_to( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, TEST_REALLOC_N ) != 0 );
+    int kept = 0;
+    cexitstack_push_full( &stack, &kept, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set );
+    unsigned int mark = cexitstack_mark( &stack );
+    assert( mark == 1 );
+    for (int iteration = 0; iteration < 3; iteration++) {
+        int results[TEST_RETURN_SET_N] = { 0 };
+        int conditions[TEST_RETURN_SET_N] = { 3, 1, CEXITSTACK_CONDITION_ALWAYS, 2, 4 };
+        int expect[TEST_RETURN_SET_N] = { 1, 0, 1, 1, 0 };
+        for (int i = 0; i < TEST_RETURN_SET_N; i++)
+            cexitstack_push_full( &stack, results + i, conditions[i], &cexitstack_func_set );
+        cexitstack_item *items = stack.items;
+        assert( cexitstack_unwind_to( &stack, mark, 2 ) );
+        assert( stack.length == mark && stack.items == items );
+        for (int i = 0; i < TEST_RETURN_SET_N; i++)
+            assert( results[i] == expect[i] );
+        assert( kept == 0 );
+    }
+    assert( cexitstack_unwind_to( &stack, mark + 1, 2 ) == 0 );
+    assert( cexitstack_return( &stack, -1, 0 ) == -1 );
+    assert( kept == 1 );
+}
+
+static int test_rollback_order[64];
+static int test_rollback_order_length;
+
+static void test_rollback_record( void *object )
+{
+    test_rollback_order[test_rollback_order_length++] = (int)(intptr_t)object;
+}
+
+// rollback items unwind interleaved with the others by position, and with marks
+void test_rollback_unwind( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, 0 ) );
+    test_rollback_order_length = 0;
+    assert( cexitstack_push_full( &stack, (void *)1, CEXITSTACK_CONDITION_ALWAYS, &test_rollback_record ) );
+    assert( cexitstack_push_rollback( &stack, (void *)2, CEXITSTACK_CONDITION_ERROR, &test_rollback_record ) );
+    assert( cexitstack_push_rollback( &stack, (void *)3, CEXITSTACK_CONDITION_ERROR, &test_rollback_record ) );
+    assert( cexitstack_push_full( &stack, (void *)4, CEXITSTACK_CONDITION_ERROR, &test_rollback_record ) );
+    unsigned int mark = cexitstack_mark( &stack );
+    assert( cexitstack_push_rollback( &stack, (void *)5, CEXITSTACK_CONDITION_ERROR, &test_rollback_record ) );
+    assert( cexitstack_push_rollback( &stack, (void *)6, 2, &test_rollback_record ) );
+    assert( cexitstack_push_full( &stack, (void *)7, CEXITSTACK_CONDITION_ALWAYS, &test_rollback_record ) );
+    // ALWAYS items can't be rolled back and go to the stack itself
+    assert( cexitstack_push_rollback( &stack, (void *)8, CEXITSTACK_CONDITION_ALWAYS, &test_rollback_record ) );
+    assert( cexitstack_push_rollback( &stack, NULL, CEXITSTACK_CONDITION_ERROR | CEXITSTACK_CONDITION_ARGS, &test_rollback_record ) == 0 );
+    assert( stack.length == 4 && stack.rollback_length == 4 );
+    assert( cexitstack_unwind_to( &stack, mark, CEXITSTACK_CONDITION_ERROR ) );
+    assert( stack.length == mark && stack.rollback_length == 2 );
+    int expect_mark[] = { 8, 7, 5 };
+    assert( test_rollback_order_length == 3 );
+    for (int i = 0; i < 3; i++)
+        assert( test_rollback_order[i] == expect_mark[i] );
+    test_rollback_order_length = 0;
+    assert( cexitstack_return( &stack, -1, CEXITSTACK_CONDITION_ERROR ) == -1 );
+    int expect[] = { 4, 3, 2, 1 };
+    assert( test_rollback_order_length == 4 );
+    for (int i = 0; i < 4; i++)
+        assert( test_rollback_order[i] == expect[i] );
+}
+
+void test_rollback_commit( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, 0 ) );
+    int always = 0, error = 0;
+    for (int round = 0; round < 2; round++) {
+        void *buffers[100];
+        for (int i = 0; i < 100; i++) {
+            buffers[i] = malloc( 16 );
+            assert( cexitstack_push_rollback( &stack, buffers[i], CEXITSTACK_CONDITION_ERROR, &cexitstack_func_free ) );
+        }
+        assert( cexitstack_push_rollback( &stack, &error, CEXITSTACK_CONDITION_ERROR, &cexitstack_func_set ) );
+        assert( cexitstack_push_full( &stack, &always, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+        assert( stack.length == 1 && stack.rollback_length == 101 );
+        cexitstack_commit( &stack );
+        assert( stack.rollback_length == 0 );
+        assert( cexitstack_reset( &stack, -1, CEXITSTACK_CONDITION_ERROR ) == -1 );
+        assert( always == 1 && error == 0 );
+        always = 0;
+        for (int i = 0; i < 100; i++)
+            free( buffers[i] );
+    }
+    cexitstack_free( &stack );
+}
+
+// a stack holding nothing but rollback items still runs them on an error return
+void test_rollback_only_return( void )
+{
+    cexitstack *stack = cexitstack_new( 0 );
+    assert( stack );
+    test_rollback_order_length = 0;
+    assert( cexitstack_push_rollback( stack, (void *)1, CEXITSTACK_CONDITION_ERROR, &test_rollback_record ) );
+    assert( cexitstack_push_rollback( stack, (void *)2, CEXITSTACK_CONDITION_ERROR, &test_rollback_record ) );
+    assert( stack->length == 0 && stack->rollback_length == 2 );
+    assert( cexitstack_return( stack, -1, CEXITSTACK_CONDITION_ERROR ) == -1 );
+    assert( test_rollback_order_length == 2 && test_rollback_order[0] == 2 && test_rollback_order[1] == 1 );
+}
+
+static void test_budget_sleep( void *object )
+{
+    thrd_sleep( &(struct timespec){ .tv_nsec = (long)(uintptr_t)object * 1000000 }, NULL );
+}
+
+// item budgets resume where the previous call stopped; args and rollback items keep their LIFO place
+void test_unwind_budget_items( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, 0 ) );
+    test_rollback_order_length = 0;
+    for (int i = 1; i <= 4; i++)
+        assert( cexitstack_push_full( &stack, (void *)(intptr_t)i, i == 2 ? 2 : CEXITSTACK_CONDITION_ERROR, &test_rollback_record ) );
+    assert( cexitstack_push_rollback( &stack, (void *)5, CEXITSTACK_CONDITION_ERROR, &test_rollback_record ) );
+    test_args_log_length = 0;
+    cexitstack_push( &stack, CEXITSTACK_ARGS( { .word = 6 }, { .size = 1006 } ), CEXITSTACK_CONDITION_ALWAYS, &test_args_record );
+    assert( cexitstack_push_full( &stack, (void *)7, CEXITSTACK_CONDITION_ERROR, &test_rollback_record ) );
+    cexitstack_budget budget = { .max_items = 2 };
+    assert( cexitstack_unwind_budget( &stack, 1, CEXITSTACK_CONDITION_ERROR, &budget ) == 0 );
+    assert( test_rollback_order_length == 1 && test_rollback_order[0] == 7 && test_args_log_length == 1 );
+    assert( stack.length == 4 && stack.rollback_length == 1 );
+    // 2 doesn't match and doesn't count
+    assert( cexitstack_unwind_budget( &stack, 1, CEXITSTACK_CONDITION_ERROR, &budget ) == 0 );
+    assert( cexitstack_unwind_budget( &stack, 1, CEXITSTACK_CONDITION_ERROR, &budget ) == 1 );
+    int expect[] = { 7, 5, 4, 3 };
+    assert( test_rollback_order_length == 4 );
+    for (int i = 0; i < 4; i++)
+        assert( test_rollback_order[i] == expect[i] );
+    assert( stack.length == 1 && stack.rollback_length == 0 );
+    // a mark above the top is an error, not a budget running out
+    assert( cexitstack_unwind_budget( &stack, 2, CEXITSTACK_CONDITION_ERROR, &budget ) == -1 );
+    assert( test_rollback_order_length == 4 && stack.length == 1 );
+    // no budget, no limits
+    for (int i = 8; i <= 10; i++)
+        assert( cexitstack_push_full( &stack, (void *)(intptr_t)i, CEXITSTACK_CONDITION_ERROR, &test_rollback_record ) );
+    assert( cexitstack_unwind_budget( &stack, 1, CEXITSTACK_CONDITION_ERROR, NULL ) == 1 );
+    assert( test_rollback_order_length == 7 && test_rollback_order[4] == 10 && test_rollback_order[6] == 8 );
+    assert( cexitstack_return( &stack, -1, CEXITSTACK_CONDITION_ERROR ) == -1 );
+    assert( test_rollback_order_length == 8 && test_rollback_order[7] == 1 );
+}
+
+void test_unwind_budget_time( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, 0 ) );
+    for (int i = 0; i < 20; i++)
+        assert( cexitstack_push_full( &stack, (void *)1, CEXITSTACK_CONDITION_ALWAYS, &test_budget_sleep ) );
+    // every cleanup sleeps for at least 1 ms, so at most 4 fit
+    cexitstack_budget budget = { .max_ns = 3500000 };
+    assert( cexitstack_unwind_budget( &stack, 0, CEXITSTACK_CONDITION_ALWAYS, &budget ) == 0 );
+    assert( stack.length < 20 && stack.length >= 16 );
+
+    // learn that the 5 ms cleanup is expensive, then a 3.5 ms budget stops right before it
+    cexitstack_costs costs = { 0 };
+    assert( cexitstack_costs_estimate( &costs, &test_budget_sleep ) == 0 );
+    assert( cexitstack_push_full( &stack, (void *)5, CEXITSTACK_CONDITION_ALWAYS, &test_budget_sleep ) );
+    cexitstack_budget learn = { .max_items = 1, .costs = &costs };
+    assert( cexitstack_unwind_budget( &stack, 0, CEXITSTACK_CONDITION_ALWAYS, &learn ) == 0 );
+    assert( cexitstack_costs_estimate( &costs, &test_budget_sleep ) >= 5000000 );
+    unsigned int length = stack.length;
+    budget.costs = &costs;
+    assert( cexitstack_unwind_budget( &stack, 0, CEXITSTACK_CONDITION_ALWAYS, &budget ) == 0 );
+    assert( stack.length == length );
+    assert( cexitstack_return( &stack, -1, CEXITSTACK_CONDITION_ALWAYS ) == -1 );
+}
+
+void test_reset( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, TEST_REALLOC_N ) != 0 );
+    for (int request = 0; request < 3; request++) {
+        int results[TEST_RETURN_SET_N] = { 0 };
+        int conditions[TEST_RETURN_SET_N] = { 3, 1, CEXITSTACK_CONDITION_ALWAYS, 2, 4 };
+        int expect[TEST_RETURN_SET_N] = { 1, 0, 1, 1, 0 };
+        for (int i = 0; i < TEST_RETURN_SET_N; i++)
+            cexitstack_push_full( &stack, results + i, conditions[i], &cexitstack_func_set );
+        unsigned int capacity = stack.capacity;
+        assert( cexitstack_reset( &stack, -1, 2 ) == -1 );
+        assert( stack.length == 0 && stack.capacity == capacity && stack.items != NULL );
+        for (int i = 0; i < TEST_RETURN_SET_N; i++)
+            assert( results[i] == expect[i] );
+    }
+    free( stack.items );
+}
+
+void test_reset_shrink( void )
+{
+    cexitstack stack;
+    assert( cexitstack_init( &stack, 0 ) != 0 );
+    cexitstack_set_shrink( &stack, 16 );
+    for (int i = 0; i < 100; i++)
+        cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free );
+    assert( stack.capacity >= 100 );
+    cexitstack_reset( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    assert( stack.length == 0 && stack.capacity == 16 );
+    for (int i = 0; i < 10; i++)
+        cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free );
+    cexitstack_reset( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    assert( stack.capacity == 16 );
+    cexitstack_free( &stack );
+}
+
 void test_generic_push_macro( void )
 {
     cexitstack stack;
@@ -214,6 +659,155 @@ void test_generic_push_macro( void )
     free( stack.items );
 }
 
+void test_inline_init( void )
+{
+    CEXITSTACK_INLINE( stack, 4 );
+    assert( stack.stack.items == stack.inline_items );
+    assert( stack.stack.capacity == 4 );
+    assert( stack.stack.length == 0 );
+    assert( stack.stack.items_inline == 1 );
+    assert( stack.stack.stack_allocated == 0 );
+}
+
+void test_inline_spill( void )
+{
+    CEXITSTACK_INLINE( stack, TEST_REALLOC_N );
+    int objects[TEST_PUSH_MULTIPLE_N] = { 10, 11, 12, 13, 14 };
+    for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++) {
+        assert( cexitstack_push_full( &stack.stack, objects + i, i, &cexitstack_func_free ) );
+        assert( stack.stack.items_inline == ( i < TEST_REALLOC_N ) );
+    }
+    assert( stack.stack.items != stack.inline_items );
+    assert( stack.stack.capacity > TEST_REALLOC_N );
+    assert( stack.stack.length == TEST_PUSH_MULTIPLE_N );
+    for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++)
+        assert( stack.stack.items[i].condition == (unsigned int)i && *(int *)stack.stack.items[i].object == objects[i] );
+    free( stack.stack.items );
+}
+
+void test_inline_return( void )
+{
+    CEXITSTACK_INLINE( stack, TEST_REALLOC_N );
+    int results[TEST_RETURN_SET_N] = { 0 };
+    int conditions[TEST_RETURN_SET_N] = { 3, 1, CEXITSTACK_CONDITION_ALWAYS, 2, 4 };
+    int expect[TEST_RETURN_SET_N] = { 1, 0, 1, 1, 0 };
+    for (int i = 0; i < TEST_RETURN_SET_N; i++)
+        cexitstack_push_full( &stack.stack, results + i, conditions[i], &cexitstack_func_set );
+    assert( cexitstack_return( &stack.stack, -1, 2 ) == -1 );
+    for (int i = 0; i < TEST_RETURN_SET_N; i++)
+        assert( results[i] == expect[i] );
+}
+
+void test_inline_return_no_spill( void )
+{
+    CEXITSTACK_INLINE( stack, TEST_RETURN_SET_N );
+    int results[TEST_RETURN_SET_N] = { 0 };
+    for (int i = 0; i < TEST_RETURN_SET_N; i++)
+        cexitstack_push_full( &stack.stack, results + i, 1, &cexitstack_func_set );
+    assert( stack.stack.items_inline == 1 );
+    assert( cexitstack_return( &stack.stack, -1, 1 ) == -1 );
+    for (int i = 0; i < TEST_RETURN_SET_N; i++)
+        assert( results[i] == 1 );
+}
+
+void test_arena_recycle( void )
+{
+    cexitstack_arena_stats stats;
+    cexitstack_arena_enable();
+    cexitstack *stack = cexitstack_new( 0 );
+    assert( stack && stack->capacity >= CEXITSTACK_DEFAULT_INITIAL_CAPACITY );
+    cexitstack_item *items = stack->items;
+    int results[TEST_RETURN_SET_N] = { 0 };
+    for (int i = 0; i < TEST_RETURN_SET_N; i++)
+        cexitstack_push_full( stack, results + i, 1, &cexitstack_func_set );
+    assert( cexitstack_return( stack, -1, 1 ) == -1 );
+    for (int i = 0; i < TEST_RETURN_SET_N; i++)
+        assert( results[i] == 1 );
+    cexitstack_arena_stats_get( &stats );
+    assert( stats.misses == 2 && stats.hits == 0 );
+    assert( stats.cached_items == 1 && stats.cached_headers == 1 );
+
+    stack = cexitstack_new( 0 );
+    assert( stack && stack->items == items && stack->length == 0 );
+    cexitstack_arena_stats_get( &stats );
+    assert( stats.misses == 2 && stats.hits == 2 );
+    assert( stats.cached_items == 0 && stats.cached_headers == 0 );
+    for (int i = 0; i < 100; i++)
+        assert( cexitstack_push_full( stack, NULL, 0, &cexitstack_func_free ) );
+    assert( cexitstack_return( stack, -1, 0 ) == -1 );
+
+    cexitstack_arena_disable();
+    cexitstack_arena_stats_get( &stats );
+    assert( stats.cached_items == 0 && stats.cached_headers == 0 );
+    stack = cexitstack_new( 12 );
+    assert( stack && stack->capacity == 12 );
+    cexitstack_return( stack, 0, 0 );
+}
+
+// with the arena, a shrink capacity between two classes means the larger class: a stack of that class
+// keeps its array on every reset, a grown one shrinks back to it
+void test_reset_shrink_arena( void )
+{
+    cexitstack stack;
+    cexitstack_arena_enable();
+    assert( cexitstack_init( &stack, 100 ) != 0 );
+    assert( stack.capacity == 128 );
+    cexitstack_set_shrink( &stack, 100 );
+    cexitstack_item *items = stack.items;
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 10; i++)
+            cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free );
+        cexitstack_reset( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+        assert( stack.items == items && stack.capacity == 128 );
+    }
+    for (int i = 0; i < 200; i++)
+        cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free );
+    cexitstack_reset( &stack, 0, CEXITSTACK_CONDITION_ALWAYS );
+    assert( stack.capacity == 128 );
+    cexitstack_free( &stack );
+    cexitstack_arena_disable();
+}
+
+void test_scope_nested( void )
+{
+    int results[TEST_RETURN_SET_N] = { 0 };
+    assert( cexitstack_scope_end( 0 ) == 0 );
+    assert( cexitstack_scope_begin() );
+    assert( cexitstack_defer( results + 0, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    assert( cexitstack_defer( results + 1, CEXITSTACK_CONDITION_ERROR, &cexitstack_func_set ) );
+    unsigned int outer_length = cexitstack_thread()->length;
+    assert( cexitstack_scope_begin() );
+    assert( cexitstack_defer( results + 2, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    assert( cexitstack_defer( results + 3, CEXITSTACK_CONDITION_ERROR, &cexitstack_func_set ) );
+    assert( cexitstack_scope_end( CEXITSTACK_CONDITION_ERROR ) );
+    assert( results[0] == 0 && results[1] == 0 && results[2] == 1 && results[3] == 1 );
+    assert( cexitstack_thread()->length == outer_length );
+    assert( cexitstack_defer( results + 4, CEXITSTACK_CONDITION_ERROR, &cexitstack_func_set ) );
+    assert( cexitstack_scope_end( CEXITSTACK_CONDITION_ALWAYS ) );
+    assert( results[0] == 1 && results[1] == 0 && results[4] == 0 );
+    assert( cexitstack_thread()->length == 0 );
+    assert( cexitstack_scope_end( 0 ) == 0 );
+}
+
+static void test_scope_defer_from_cleanup_func( void *target )
+{
+    cexitstack_defer( target, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set );
+}
+
+void test_scope_defer_from_cleanup( void )
+{
+    int result = 0;
+    assert( cexitstack_scope_begin() );
+    for (int i = 0; i < 20; i++)
+        assert( cexitstack_defer( NULL, CEXITSTACK_CONDITION_ERROR, &cexitstack_func_free ) );
+    assert( cexitstack_defer( &result, CEXITSTACK_CONDITION_ALWAYS, &test_scope_defer_from_cleanup_func ) );
+    assert( cexitstack_scope_end( CEXITSTACK_CONDITION_ALWAYS ) );
+    assert( result == 1 );
+    assert( cexitstack_thread()->length == 0 );
+    cexitstack_thread_free();
+    assert( cexitstack_scope_end( 0 ) == 0 );
+}
+
 void test_macro_init( void )
 {
     CEXITSTACK( stack, 10 );
@@ -255,6 +849,906 @@ void test_macro_return( void )
         assert( results[i] == expect[i] );
 }
 
+int test_macro_args_internal( void )
+{
+    CEXITSTACK( stack, 5 );
+    CEXITSTACK_PUSH_ARGS( stack, CEXITSTACK_ARGS( { .word = 7 }, { .size = 1007 } ), CEXITSTACK_CONDITION_ERROR, &test_args_record );
+    CEXITSTACK_PUSH( stack, NULL, 0, &cexitstack_func_free );
+    CEXITSTACK_PUSH_ARGS( stack, CEXITSTACK_ARGS( { .word = 8 }, { .size = 1008 } ), 2, &test_args_record );
+    assert( stack.length == 5 && stack.items[4].condition == ( 2 | CEXITSTACK_CONDITION_ARGS ) );
+    CEXITSTACK_RETURN( stack, -1, CEXITSTACK_CONDITION_ERROR );
+}
+
+void test_macro_args( void )
+{
+    test_args_log_length = 0;
+    assert( test_macro_args_internal() == -1 );
+    assert( test_args_log_length == 1 && test_args_log[0] == 7 );
+}
+
+#ifdef CEXITSTACK_SCOPED
+void test_scoped_init( void )
+{
+    unsigned int condition = CEXITSTACK_CONDITION_ALWAYS;
+    CEXITSTACK_SCOPED( stack, 10, condition );
+    assert( stack.items != NULL );
+    assert( stack.capacity == 10 );
+    assert( stack.length == 0 );
+    assert( stack.condition == &condition );
+}
+
+void test_scoped_push( void )
+{
+    unsigned int condition = CEXITSTACK_CONDITION_ALWAYS;
+    CEXITSTACK_SCOPED( stack, 5, condition );
+    int objects[2] = { 1, 2 };
+    CEXITSTACK_PUSH( stack, &objects[0], 2, &cexitstack_func_set );
+    CEXITSTACK_PUSH( stack, &objects[1], 3, &cexitstack_func_set );
+    assert( stack.capacity == 5 && stack.length == 2 );
+    assert( stack.items[0].condition == 2 && *(int *)( stack.items[0].object ) == 1 && stack.items[0].func == &cexitstack_func_set );
+    assert( stack.items[1].condition == 3 && *(int *)( stack.items[1].object ) == 2 && stack.items[1].func == &cexitstack_func_set );
+    stack.length = 0;
+}
+
+int test_scoped_return_internal( int *results, int fail_early )
+{
+    unsigned int error = 0;
+    CEXITSTACK_SCOPED( stack, TEST_MACRO_RETURN_N, error );
+    int conditions[TEST_MACRO_RETURN_N] = { 3, 1, CEXITSTACK_CONDITION_ALWAYS, 2, 4 };
+    for (int i = 0; i < TEST_MACRO_RETURN_N; i++) {
+        CEXITSTACK_PUSH( stack, results + i, conditions[i], &cexitstack_func_set );
+        if (fail_early && i == 2) {
+            error = 2;
+            return -2;
+        }
+    }
+    assert( stack.length == TEST_MACRO_RETURN_N );
+    error = 2;
+    return -1;
+}
+
+void test_scoped_return( void )
+{
+    int results[TEST_MACRO_RETURN_N] = { 0 };
+    int expect[TEST_MACRO_RETURN_N] = { 1, 0, 1, 1, 0 };
+    assert( test_scoped_return_internal( results, 0 ) == -1 );
+    for (int i = 0; i < TEST_MACRO_RETURN_N; i++)
+        assert( results[i] == expect[i] );
+
+    int results_early[TEST_MACRO_RETURN_N] = { 0 };
+    int expect_early[TEST_MACRO_RETURN_N] = { 1, 0, 1, 0, 0 };
+    assert( test_scoped_return_internal( results_early, 1 ) == -2 );
+    for (int i = 0; i < TEST_MACRO_RETURN_N; i++)
+        assert( results_early[i] == expect_early[i] );
+}
+
+void test_scoped_block_exit( void )
+{
+    int results[3] = { 0 };
+    for (int i = 0; i < 3; i++) {
+        unsigned int condition = CEXITSTACK_CONDITION_ALWAYS;
+        CEXITSTACK_SCOPED( stack, 1, condition );
+        CEXITSTACK_PUSH( stack, results + i, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set );
+        if (i == 1) break;
+    }
+    assert( results[0] == 1 && results[1] == 1 && results[2] == 0 );
+}
+
+static void test_scoped_count( void *target )
+{
+    ( *(int *)target )++;
+}
+
+int test_scoped_macro_return_internal( int *counter )
+{
+    unsigned int condition = CEXITSTACK_CONDITION_ALWAYS;
+    CEXITSTACK_SCOPED( stack, 1, condition );
+    CEXITSTACK_PUSH( stack, counter, CEXITSTACK_CONDITION_ALWAYS, &test_scoped_count );
+    CEXITSTACK_RETURN( stack, -1, CEXITSTACK_CONDITION_ALWAYS );
+}
+
+void test_scoped_macro_return( void )
+{
+    int counter = 0;
+    assert( test_scoped_macro_return_internal( &counter ) == -1 );
+    assert( counter == 1 );
+}
+#endif
+
+void test_compact_init( void )
+{
+    cexitstack_compact stack;
+    assert( cexitstack_compact_init( &stack, 0 ) != 0 );
+    assert( stack.capacity == CEXITSTACK_DEFAULT_INITIAL_CAPACITY );
+    assert( stack.length == 0 && stack.func_count == 0 && stack.stack_allocated == 0 );
+    assert( stack.objects && stack.conditions && stack.funcs );
+    cexitstack_compact_free( &stack );
+    cexitstack_compact *heap_stack = cexitstack_compact_new( 12 );
+    assert( heap_stack && heap_stack->capacity == 12 && heap_stack->stack_allocated == 1 );
+    cexitstack_compact_free( heap_stack );
+}
+
+void test_compact_push( void )
+{
+    cexitstack_compact stack;
+    assert( cexitstack_compact_init( &stack, TEST_REALLOC_N ) != 0 );
+    int objects[TEST_PUSH_MULTIPLE_N] = { 10, 11, 12, 13, 14 };
+    for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++)
+        assert( cexitstack_compact_push_full( &stack, objects + i, i, i % 2 ? &cexitstack_func_set : &cexitstack_func_free ) );
+    assert( stack.length == TEST_PUSH_MULTIPLE_N && stack.capacity >= TEST_PUSH_MULTIPLE_N );
+    assert( stack.func_count == 2 );
+    for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++) {
+        assert( stack.objects[i] == objects + i && stack.conditions[i] == (unsigned int)i );
+        assert( stack.func_table[stack.funcs[i]] == ( i % 2 ? &cexitstack_func_set : &cexitstack_func_free ) );
+    }
+    cexitstack_compact_free( &stack );
+}
+
+static void test_compact_func_a( void *object ) { cexitstack_func_set( object ); }
+static void test_compact_func_b( void *object ) { cexitstack_func_set( object ); }
+
+void test_compact_func_table_full( void )
+{
+    cexitstack_compact stack;
+    assert( cexitstack_compact_init( &stack, 0 ) != 0 );
+    for (unsigned int i = 0; i < CEXITSTACK_COMPACT_MAX_FUNCS - 1; i++)
+        stack.func_table[i] = &cexitstack_func_free;
+    stack.func_count = CEXITSTACK_COMPACT_MAX_FUNCS - 1;
+    assert( cexitstack_compact_push_full( &stack, NULL, 0, &test_compact_func_a ) );
+    assert( cexitstack_compact_push_full( &stack, NULL, 0, &test_compact_func_a ) );
+    assert( !cexitstack_compact_push_full( &stack, NULL, 0, &test_compact_func_b ) );
+    assert( stack.length == 2 );
+    cexitstack_compact_free( &stack );
+}
+
+void test_compact_return( void )
+{
+    cexitstack_compact stack;
+    assert( cexitstack_compact_init( &stack, TEST_REALLOC_N ) != 0 );
+    int results[TEST_RETURN_SET_N] = { 0 };
+    int conditions[TEST_RETURN_SET_N] = { 3, 1, CEXITSTACK_CONDITION_ALWAYS, 2, 4 };
+    int expect[TEST_RETURN_SET_N] = { 1, 0, 1, 1, 0 };
+    for (int i = 0; i < TEST_RETURN_SET_N; i++)
+        cexitstack_compact_push_full( &stack, results + i, conditions[i], i % 2 ? &test_compact_func_a : &test_compact_func_b );
+    assert( cexitstack_compact_return( &stack, -1, 2 ) == -1 );
+    for (int i = 0; i < TEST_RETURN_SET_N; i++)
+        assert( results[i] == expect[i] );
+}
+
+static int test_compact_order[200];
+static int test_compact_order_length;
+
+static void test_compact_record( void *object )
+{
+    test_compact_order[test_compact_order_length++] = (int)(intptr_t)object;
+}
+
+static void test_compact_record2( void *object )
+{
+    test_compact_record( object );
+}
+
+void test_compact_return_many( void )
+{
+    cexitstack_compact stack;
+    assert( cexitstack_compact_init( &stack, 0 ) != 0 );
+    unsigned int conditions[200];
+    for (int i = 0; i < 200; i++) {
+        conditions[i] = i % 7 == 0 ? CEXITSTACK_CONDITION_ALWAYS : (unsigned int)( 1 << ( i % 3 ) );
+        assert( cexitstack_compact_push_full( &stack, (void *)(intptr_t)i, conditions[i], ( i / 5 ) % 2 ? &test_compact_record : &test_compact_record2 ) );
+    }
+    test_compact_order_length = 0;
+    assert( cexitstack_compact_return( &stack, -1, 2 | 4 ) == -1 );
+    int expected = 0;
+    for (int i = 199; i >= 0; i--)
+        if (conditions[i] == CEXITSTACK_CONDITION_ALWAYS || ( 2 | 4 ) & conditions[i])
+            assert( test_compact_order[expected++] == i );
+    assert( test_compact_order_length == expected );
+}
+
+void test_concurrent_return( void )
+{
+    cexitstack_concurrent stack;
+    assert( cexitstack_concurrent_init( &stack ) );
+    int results[TEST_RETURN_SET_N] = { 0 };
+    int conditions[TEST_RETURN_SET_N] = { 3, 1, CEXITSTACK_CONDITION_ALWAYS, 2, 4 };
+    int expect[TEST_RETURN_SET_N] = { 1, 0, 1, 1, 0 };
+    for (int i = 0; i < TEST_RETURN_SET_N; i++)
+        assert( cexitstack_concurrent_push_full( &stack, results + i, conditions[i], &cexitstack_func_set ) );
+    assert( cexitstack_concurrent_return( &stack, -1, 2 ) == -1 );
+    for (int i = 0; i < TEST_RETURN_SET_N; i++)
+        assert( results[i] == expect[i] );
+
+    cexitstack_concurrent *heap_stack = cexitstack_concurrent_new();
+    assert( heap_stack && heap_stack->stack_allocated );
+    for (int i = 0; i < CEXITSTACK_CONCURRENT_CHUNK_CAPACITY * 3; i++)
+        assert( cexitstack_concurrent_push_full( heap_stack, malloc( 8 ), 0, &cexitstack_func_free ) );
+    assert( cexitstack_concurrent_return( heap_stack, -1, 0 ) == -1 );
+}
+
+#define TEST_CONCURRENT_THREADS 8
+#define TEST_CONCURRENT_PUSHES 20000
+typedef struct
+{
+    cexitstack_concurrent *stack;
+    int thread;
+} test_concurrent_worker_args;
+
+// per thread: the sequence number seen last while unwinding, must go down strictly
+static int test_concurrent_last[TEST_CONCURRENT_THREADS + 1];
+static int test_concurrent_ran;
+
+static void test_concurrent_check( void *object )
+{
+    intptr_t value = (intptr_t)object;
+    int thread = (int)( value / ( TEST_CONCURRENT_PUSHES + 1 ) );
+    int sequence = (int)( value % ( TEST_CONCURRENT_PUSHES + 1 ) );
+    assert( sequence < test_concurrent_last[thread] );
+    test_concurrent_last[thread] = sequence;
+    test_concurrent_ran++;
+}
+
+static int test_concurrent_worker( void *arg )
+{
+    test_concurrent_worker_args *args = arg;
+    for (int i = 0; i < TEST_CONCURRENT_PUSHES; i++) {
+        intptr_t value = (intptr_t)args->thread * ( TEST_CONCURRENT_PUSHES + 1 ) + i;
+        if (!cexitstack_concurrent_push_full( args->stack, (void *)value, CEXITSTACK_CONDITION_ALWAYS, &test_concurrent_check ))
+            return 1;
+    }
+    return 0;
+}
+
+void test_concurrent_stress( void )
+{
+    cexitstack_concurrent *stack = cexitstack_concurrent_new();
+    assert( stack );
+    thrd_t threads[TEST_CONCURRENT_THREADS];
+    test_concurrent_worker_args args[TEST_CONCURRENT_THREADS];
+    for (int t = 0; t < TEST_CONCURRENT_THREADS; t++) {
+        args[t] = ( test_concurrent_worker_args ){ .stack = stack, .thread = t };
+        assert( thrd_create( threads + t, &test_concurrent_worker, args + t ) == thrd_success );
+    }
+    test_concurrent_worker_args own = { .stack = stack, .thread = TEST_CONCURRENT_THREADS };
+    assert( test_concurrent_worker( &own ) == 0 );
+    for (int t = 0; t < TEST_CONCURRENT_THREADS; t++) {
+        int result;
+        assert( thrd_join( threads[t], &result ) == thrd_success && result == 0 );
+    }
+    for (int t = 0; t <= TEST_CONCURRENT_THREADS; t++)
+        test_concurrent_last[t] = TEST_CONCURRENT_PUSHES;
+    test_concurrent_ran = 0;
+    assert( cexitstack_concurrent_return( stack, -1, 0 ) == -1 );
+    assert( test_concurrent_ran == ( TEST_CONCURRENT_THREADS + 1 ) * TEST_CONCURRENT_PUSHES );
+    for (int t = 0; t <= TEST_CONCURRENT_THREADS; t++)
+        assert( test_concurrent_last[t] == 0 );
+}
+
+#define TEST_PARALLEL_N 1000
+static atomic_int test_parallel_ran;
+static int test_parallel_ordered_seen;
+
+static void test_parallel_count( void *object )
+{
+    atomic_fetch_add( &test_parallel_ran, 1 );
+    *(int *)object += 1;
+}
+
+// ordered items must see every independent item above them finished
+static void test_parallel_ordered( void *object )
+{
+    assert( atomic_load( &test_parallel_ran ) == *(int *)object );
+    test_parallel_ordered_seen++;
+}
+
+void test_return_parallel( void )
+{
+    cexitstack_pool *pool = cexitstack_pool_new( 3 );
+    assert( pool );
+    static int results[TEST_PARALLEL_N];
+    // ordered items at 0, 400 and 800, each expects the matching independent items above it to be done
+    int expected_before[3] = { 0 };
+    int expected_ran = 0;
+    cexitstack *stack = cexitstack_new( 0 );
+    assert( stack );
+    for (int i = 0; i < TEST_PARALLEL_N; i++) {
+        results[i] = 0;
+        if (i % 400 == 0) {
+            assert( cexitstack_push_full( stack, expected_before + i / 400, 1, &test_parallel_ordered ) );
+            continue;
+        }
+        unsigned int condition = CEXITSTACK_CONDITION_INDEPENDENT | ( i % 7 == 0 ? 4 : i % 2 ? CEXITSTACK_CONDITION_ALWAYS : 1 );
+        assert( cexitstack_push_full( stack, results + i, condition, &test_parallel_count ) );
+        if (i % 7 != 0)
+            for (int k = 0; k * 400 < i; k++)
+                expected_before[k]++;
+    }
+    atomic_store( &test_parallel_ran, 0 );
+    test_parallel_ordered_seen = 0;
+    assert( cexitstack_return_parallel( stack, -1, 1, pool ) == -1 );
+    for (int i = 0; i < TEST_PARALLEL_N; i++) {
+        if (i % 400 == 0) continue;
+        assert( results[i] == ( i % 7 != 0 ) );
+        expected_ran += i % 7 != 0;
+    }
+    assert( atomic_load( &test_parallel_ran ) == expected_ran );
+    assert( test_parallel_ordered_seen == 3 );
+
+    // without a pool everything runs on the calling thread
+    int result = 0;
+    stack = cexitstack_new( 0 );
+    assert( stack );
+    assert( cexitstack_push_full( stack, &result, CEXITSTACK_CONDITION_INDEPENDENT | CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    assert( cexitstack_return_parallel( stack, 0, 0, NULL ) == 0 );
+    assert( result == 1 );
+    cexitstack_pool_free( pool );
+}
+
+#define TEST_DEFERRED_N 1000
+static int test_deferred_order[TEST_DEFERRED_N];
+static int test_deferred_order_length;
+
+static void test_deferred_record( void *object )
+{
+    test_deferred_order[test_deferred_order_length++] = (int)(intptr_t)object;
+}
+
+void test_return_deferred( void )
+{
+    cexitstack_reclaimer *reclaimer = cexitstack_reclaimer_new( 8 );
+    assert( reclaimer );
+    cexitstack *stack = cexitstack_new( 0 );
+    assert( stack );
+    for (int i = 0; i < TEST_DEFERRED_N; i++)
+        assert( cexitstack_push_full( stack, (void *)(intptr_t)i, i % 3 ? 1 : 2, &test_deferred_record ) );
+    test_deferred_order_length = 0;
+    assert( cexitstack_return_deferred( stack, -1, 1, reclaimer ) == -1 );
+    cexitstack_reclaimer_flush( reclaimer );
+    int expected = 0;
+    for (int i = TEST_DEFERRED_N - 1; i >= 0; i--)
+        if (i % 3)
+            assert( test_deferred_order[expected++] == i );
+    assert( test_deferred_order_length == expected );
+    cexitstack_reclaimer_stats stats;
+    cexitstack_reclaimer_stats_get( reclaimer, &stats );
+    assert( stats.queued == (unsigned long long)expected && stats.completed == stats.queued );
+    assert( stats.producer_waits > 0 );
+
+    // freeing the reclaimer runs what is still queued
+    stack = cexitstack_new( 0 );
+    assert( stack );
+    for (int i = 0; i < 100; i++)
+        assert( cexitstack_push_full( stack, malloc( 16 ), CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free ) );
+    assert( cexitstack_return_deferred( stack, 0, 0, reclaimer ) == 0 );
+    cexitstack_reclaimer_free( reclaimer );
+
+    int result = 0;
+    cexitstack local;
+    assert( cexitstack_init( &local, 0 ) );
+    assert( cexitstack_push_full( &local, &result, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    assert( cexitstack_return_deferred( &local, 0, 0, NULL ) == 0 );
+    assert( result == 1 );
+}
+
+// an args item at the end of a reclaimer batch is taken with its args, whatever bits they have
+void test_return_deferred_args_batch( void )
+{
+    cexitstack_reclaimer *reclaimer = cexitstack_reclaimer_new( 4 * CEXITSTACK_RECLAIM_BATCH );
+    assert( reclaimer );
+    cexitstack *stack = cexitstack_new( 0 );
+    assert( stack );
+    for (int i = 0; i < 10; i++)
+        assert( cexitstack_push_full( stack, (void *)(intptr_t)i, CEXITSTACK_CONDITION_ALWAYS, &test_deferred_record ) );
+    // the low word of the second arg overlays an item's condition: CEXITSTACK_CONDITION_ARGS and more
+    size_t word = 0x7FFFFC17;
+    assert( cexitstack_push_args( stack, CEXITSTACK_ARGS( { .word = word }, { .size = 1000 + word } ), CEXITSTACK_CONDITION_ALWAYS,
+                                  &test_args_record ) );
+    for (int i = 10; i < 10 + CEXITSTACK_RECLAIM_BATCH - 1; i++)
+        assert( cexitstack_push_full( stack, (void *)(intptr_t)i, CEXITSTACK_CONDITION_ALWAYS, &test_deferred_record ) );
+    test_deferred_order_length = 0;
+    test_args_log_length = 0;
+    assert( cexitstack_return_deferred( stack, 0, CEXITSTACK_CONDITION_ALWAYS, reclaimer ) == 0 );
+    cexitstack_reclaimer_flush( reclaimer );
+    assert( test_args_log_length == 1 && test_args_log[0] == (int)word );
+    assert( test_deferred_order_length == 10 + CEXITSTACK_RECLAIM_BATCH - 1 );
+    for (int i = 0; i < test_deferred_order_length; i++)
+        assert( test_deferred_order[i] == 10 + CEXITSTACK_RECLAIM_BATCH - 2 - i );
+    cexitstack_reclaimer_free( reclaimer );
+}
+
+void test_context_switch( void )
+{
+    int results[3] = { 0 };
+    cexitstack_context task;
+    cexitstack_context_init( &task );
+    assert( cexitstack_defer( results + 0, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    unsigned int thread_length = cexitstack_thread()->length;
+    assert( cexitstack_context_switch( &task ) == NULL );
+    assert( cexitstack_context_current() == &task );
+    assert( cexitstack_scope_begin() );
+    assert( cexitstack_defer( results + 1, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    assert( cexitstack_scope_begin() );
+    assert( cexitstack_defer( results + 2, CEXITSTACK_CONDITION_ERROR, &cexitstack_func_set ) );
+    assert( cexitstack_context_switch( NULL ) == &task );
+    assert( cexitstack_thread()->length == thread_length );
+    // cancelling unwinds through both open scopes
+    assert( cexitstack_context_return( &task, -1, CEXITSTACK_CONDITION_ERROR ) == -1 );
+    assert( results[0] == 0 && results[1] == 1 && results[2] == 1 );
+    assert( task.stack.items == NULL && task.scope == 0 );
+    assert( cexitstack_scope_end( 0 ) == 0 );
+    cexitstack_thread_free();
+    assert( results[0] == 0 );
+}
+
+#ifdef __linux__
+// a minimal ucontext scheduler: every task defers allocations into its own cexitstack_context
+// across suspensions, tasks are resumed on either of two threads, and then all are cancelled
+#define TEST_TASKS 100000
+// task stacks are carved from one reserved region, so only the pages a task touches cost memory
+#define TEST_TASK_STACK_SIZE 16384
+
+typedef struct
+{
+    ucontext_t context;
+    ucontext_t *scheduler;
+    cexitstack_context exitstack;
+    int steps;
+    void *stack;
+} test_task;
+
+static _Thread_local ucontext_t test_scheduler_context;
+static _Thread_local test_task *test_task_running;
+static atomic_int test_task_allocations;
+static atomic_int test_task_frees;
+
+static void test_task_free( void *object )
+{
+    free( object );
+    atomic_fetch_add( &test_task_frees, 1 );
+}
+
+static void *test_task_alloc( void )
+{
+    atomic_fetch_add( &test_task_allocations, 1 );
+    return malloc( 24 );
+}
+
+// task code must not hold on to thread-local addresses across a yield, the task may resume elsewhere
+static void test_task_yield( test_task *task )
+{
+    assert( swapcontext( &task->context, task->scheduler ) == 0 );
+}
+
+static void test_task_main( void )
+{
+    test_task *task = test_task_running;
+    cexitstack_defer( test_task_alloc(), CEXITSTACK_CONDITION_ALWAYS, &test_task_free );
+    task->steps++;
+    test_task_yield( task );
+    cexitstack_scope_begin();
+    cexitstack_defer( test_task_alloc(), CEXITSTACK_CONDITION_ERROR, &test_task_free );
+    task->steps++;
+    test_task_yield( task );
+    cexitstack_defer( test_task_alloc(), CEXITSTACK_CONDITION_ALWAYS, &test_task_free );
+    task->steps++;
+    test_task_yield( task );
+    // only reached by tasks that aren't cancelled, which never happens here
+    cexitstack_scope_end( CEXITSTACK_CONDITION_ALWAYS );
+}
+
+static void test_task_resume( test_task *task )
+{
+    cexitstack_context *previous = cexitstack_context_switch( &task->exitstack );
+    test_task_running = task;
+    task->scheduler = &test_scheduler_context;
+    assert( swapcontext( &test_scheduler_context, &task->context ) == 0 );
+    test_task_running = NULL;
+    assert( cexitstack_context_switch( previous ) == &task->exitstack );
+}
+
+static int test_task_resume_all( void *arg )
+{
+    test_task *tasks = arg;
+    for (int i = 0; i < TEST_TASKS; i++)
+        test_task_resume( tasks + i );
+    return 0;
+}
+
+// kept out of the loop calling it, so that getcontext can't clobber the loop's locals
+static void test_task_init( test_task *task, void *stack )
+{
+    task->stack = stack;
+    assert( getcontext( &task->context ) == 0 );
+    task->context.uc_stack.ss_sp = task->stack;
+    task->context.uc_stack.ss_size = TEST_TASK_STACK_SIZE;
+    task->context.uc_link = NULL;
+    makecontext( &task->context, &test_task_main, 0 );
+    cexitstack_context_init( &task->exitstack );
+}
+
+void test_context_tasks_cancel( void )
+{
+    test_task *tasks = calloc( TEST_TASKS, sizeof( test_task ) );
+    assert( tasks );
+    size_t stacks_size = (size_t)TEST_TASKS * TEST_TASK_STACK_SIZE;
+    char *stacks = mmap( NULL, stacks_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+    assert( stacks != MAP_FAILED );
+    for (int i = 0; i < TEST_TASKS; i++)
+        test_task_init( tasks + i, stacks + (size_t)i * TEST_TASK_STACK_SIZE );
+    test_task_resume_all( tasks );
+    // second step of every task runs on another thread
+    thrd_t thread;
+    assert( thrd_create( &thread, &test_task_resume_all, tasks ) == thrd_success );
+    assert( thrd_join( thread, NULL ) == thrd_success );
+    test_task_resume_all( tasks );
+    assert( atomic_load( &test_task_allocations ) == 3 * TEST_TASKS );
+    for (int i = 0; i < TEST_TASKS; i++) {
+        assert( tasks[i].steps == 3 );
+        assert( cexitstack_context_return( &tasks[i].exitstack, -1, CEXITSTACK_CONDITION_ERROR ) == -1 );
+    }
+    munmap( stacks, stacks_size );
+    assert( atomic_load( &test_task_frees ) == atomic_load( &test_task_allocations ) );
+    assert( cexitstack_context_current() != &tasks[0].exitstack );
+    free( tasks );
+}
+#endif
+
+#ifdef __linux__
+static void test_persist_touch( const char *path )
+{
+    int fd = open( path, O_WRONLY | O_CREAT, 0600 );
+    assert( fd >= 0 );
+    close( fd );
+}
+
+static int test_persist_exists( const char *path )
+{
+    return access( path, F_OK ) == 0;
+}
+
+void test_persist_unwind( void )
+{
+    char dir[] = "/tmp/cexitstack_test_XXXXXX", log[64], files[3][64];
+    assert( mkdtemp( dir ) );
+    snprintf( log, sizeof( log ), "%s.log", dir );
+    // a small file and a sync on every push, so the log has to grow and gets synced
+    cexitstack_persist *stack = cexitstack_persist_open( log, 64, 1 );
+    assert( stack );
+    assert( cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_RMDIR, dir, CEXITSTACK_CONDITION_ALWAYS ) );
+    for (int i = 0; i < 3; i++) {
+        snprintf( files[i], sizeof( files[i] ), "%s/file%d", dir, i );
+        test_persist_touch( files[i] );
+        assert( cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, files[i], i == 1 ? CEXITSTACK_CONDITION_ERROR : CEXITSTACK_CONDITION_ALWAYS ) );
+    }
+    int fds[2];
+    assert( pipe( fds ) == 0 );
+    assert( cexitstack_persist_push_id( stack, CEXITSTACK_PERSIST_CLOSE, fds[0], CEXITSTACK_CONDITION_ALWAYS ) );
+    assert( cexitstack_persist_push_id( stack, CEXITSTACK_PERSIST_UNLINK, 0, CEXITSTACK_CONDITION_ALWAYS ) == 0 );
+    assert( cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_SHMID, "x", CEXITSTACK_CONDITION_ALWAYS ) == 0 );
+    assert( cexitstack_persist_mark( stack ) == 5 );
+    assert( cexitstack_persist_unwind_to( stack, 3, CEXITSTACK_CONDITION_ALWAYS ) );
+    assert( fcntl( fds[0], F_GETFD ) == -1 && !test_persist_exists( files[2] ) && test_persist_exists( files[1] ) );
+    assert( cexitstack_persist_unwind_to( stack, 4, CEXITSTACK_CONDITION_ALWAYS ) == 0 );
+    assert( cexitstack_persist_return( stack, -1, CEXITSTACK_CONDITION_ERROR ) == -1 );
+    assert( !test_persist_exists( files[1] ) && !test_persist_exists( files[0] ) && !test_persist_exists( dir ) );
+    assert( !test_persist_exists( log ) );
+    close( fds[1] );
+
+    // once the stack is empty the log starts over, so a replay doesn't see the entries before
+    snprintf( files[0], sizeof( files[0] ), "%s.file", dir );
+    test_persist_touch( files[0] );
+    stack = cexitstack_persist_open( log, 0, 0 );
+    assert( stack );
+    assert( cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, files[0], CEXITSTACK_CONDITION_ERROR ) );
+    assert( cexitstack_persist_unwind_to( stack, 0, CEXITSTACK_CONDITION_ALWAYS ) );
+    assert( cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, files[0], 2 ) );
+    cexitstack_persist_close( stack );
+    assert( cexitstack_persist_replay( log, CEXITSTACK_CONDITION_ERROR ) == 0 && test_persist_exists( files[0] ) );
+    assert( cexitstack_persist_replay( log, 2 ) == 1 && !test_persist_exists( files[0] ) );
+    unlink( log );
+}
+
+// a child process pushes entries, unwinds some of them and dies; the replay runs only the rest
+void test_persist_replay( void )
+{
+    char dir[] = "/tmp/cexitstack_test_XXXXXX", log[64], kept[64], popped[64], files[100][64];
+    assert( mkdtemp( dir ) );
+    snprintf( log, sizeof( log ), "%s.log", dir );
+    snprintf( kept, sizeof( kept ), "%s/kept", dir );
+    snprintf( popped, sizeof( popped ), "%s/popped", dir );
+    test_persist_touch( kept );
+    for (int i = 0; i < 100; i++) {
+        snprintf( files[i], sizeof( files[i] ), "%s/file%d", dir, i );
+        test_persist_touch( files[i] );
+    }
+    pid_t child = fork();
+    assert( child >= 0 );
+    if (child == 0) {
+        cexitstack_persist *stack = cexitstack_persist_open( log, 0, 0 );
+        if (!stack) _exit( 1 );
+        cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_RMDIR, dir, CEXITSTACK_CONDITION_ERROR );
+        cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, kept, 2 );
+        for (int i = 0; i < 100; i++)
+            cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, files[i], CEXITSTACK_CONDITION_ALWAYS );
+        unsigned int mark = cexitstack_persist_mark( stack );
+        cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, popped, CEXITSTACK_CONDITION_ALWAYS );
+        cexitstack_persist_unwind_to( stack, mark, CEXITSTACK_CONDITION_ERROR );
+        // dies without running or closing anything
+        _exit( 0 );
+    }
+    int status;
+    assert( waitpid( child, &status, 0 ) == child && WIFEXITED( status ) && WEXITSTATUS( status ) == 0 );
+    test_persist_touch( popped );
+    assert( cexitstack_persist_replay( log, CEXITSTACK_CONDITION_ERROR ) == 101 );
+    for (int i = 0; i < 100; i++)
+        assert( !test_persist_exists( files[i] ) );
+    // kept (condition 2) and popped (already unwound) are still there, so rmdir failed
+    assert( test_persist_exists( kept ) && test_persist_exists( popped ) && test_persist_exists( dir ) );
+    assert( cexitstack_persist_replay( log, CEXITSTACK_CONDITION_ERROR | 2 ) == 102 );
+    assert( !test_persist_exists( kept ) && test_persist_exists( popped ) );
+    unlink( popped );
+    rmdir( dir );
+    unlink( log );
+    assert( cexitstack_persist_replay( log, CEXITSTACK_CONDITION_ERROR ) == -1 );
+}
+
+static void test_persist_torn_exit( int signal )
+{
+    (void)signal;
+    _exit( 3 );
+}
+
+// a child process overwrites a record of the previous generation and crashes halfway through: the
+// record's fields sit below a page boundary and are written, its name above it can't be; the replay
+// must not take the rest of the old record for the new one
+void test_persist_torn( void )
+{
+    char dir[] = "/tmp/cexitstack_test_XXXXXX", log[64], stale[64], torn[64];
+    assert( mkdtemp( dir ) );
+    snprintf( log, sizeof( log ), "%s.log", dir );
+    snprintf( stale, sizeof( stale ), "%s/stale", dir );
+    snprintf( torn, sizeof( torn ), "%s/torn", dir );
+    test_persist_touch( stale );
+    size_t page = (size_t)sysconf( _SC_PAGESIZE );
+    // the filler's record takes the log up to 24 bytes (the fixed part of a record) below the page
+    // boundary, after the 16 byte header
+    char *filler = malloc( page );
+    assert( filler );
+    size_t filler_length = page - 65;
+    memset( filler, 'f', filler_length );
+    memcpy( filler, dir, strlen( dir ) );
+    filler[strlen( dir )] = '/';
+    filler[filler_length] = 0;
+    pid_t child = fork();
+    assert( child >= 0 );
+    if (child == 0) {
+        cexitstack_persist *stack = cexitstack_persist_open( log, 0, 0 );
+        if (!stack) _exit( 1 );
+        cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, filler, 2 );
+        cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, stale, 2 );
+        // empties the stack without running anything, so the log starts over
+        cexitstack_persist_unwind_to( stack, 0, CEXITSTACK_CONDITION_ERROR );
+        cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, filler, 2 );
+        FILE *maps = fopen( "/proc/self/maps", "r" );
+        if (!maps) _exit( 1 );
+        char line[256];
+        unsigned long start = 0;
+        while (fgets( line, sizeof( line ), maps ))
+            if (strstr( line, log )) {
+                sscanf( line, "%lx-", &start );
+                break;
+            }
+        fclose( maps );
+        if (!start || mprotect( (void *)( start + page ), page, PROT_READ ) != 0) _exit( 1 );
+        struct sigaction action = { .sa_handler = &test_persist_torn_exit };
+        sigaction( SIGSEGV, &action, NULL );
+        cexitstack_persist_push_name( stack, CEXITSTACK_PERSIST_UNLINK, torn, CEXITSTACK_CONDITION_ERROR );
+        _exit( 0 );
+    }
+    int status;
+    assert( waitpid( child, &status, 0 ) == child && WIFEXITED( status ) && WEXITSTATUS( status ) == 3 );
+    assert( cexitstack_persist_replay( log, CEXITSTACK_CONDITION_ERROR ) == 0 );
+    assert( test_persist_exists( stale ) );
+    unlink( stale );
+    rmdir( dir );
+    unlink( log );
+    free( filler );
+}
+#endif
+
+#ifdef CEXITSTACK_STATS
+static void test_stats_noop( void *object ) { (void)object; }
+
+void test_stats( void )
+{
+    cexitstack_stats_reset();
+    cexitstack stack;
+    assert( cexitstack_init( &stack, 2 ) );
+    assert( cexitstack_push_full( &stack, NULL, CEXITSTACK_CONDITION_ALWAYS, &test_stats_noop ) );
+    assert( cexitstack_push_full( &stack, NULL, 4, &test_stats_noop ) );
+    assert( cexitstack_push_full( &stack, malloc( 8 ), 2, &cexitstack_func_free ) );
+    assert( cexitstack_push_full( &stack, malloc( 8 ), CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_free ) );
+    assert( cexitstack_return( &stack, 0, 2 ) == 0 );
+    cexitstack_stats *stats = malloc( sizeof( cexitstack_stats ) );
+    assert( stats );
+    cexitstack_stats_get( stats );
+    assert( stats->pushes == 4 && stats->peak_depth == 4 );
+    assert( stats->expands == 1 && stats->bytes_copied == 2 * sizeof( cexitstack_item ) );
+    assert( stats->executed[0] == 2 && stats->executed[2] == 1 && stats->skipped[3] == 1 );
+    unsigned long long noop_calls = 0, free_calls = 0;
+    for (unsigned int f = 0; f < stats->func_count; f++) {
+        if (stats->funcs[f].func == &test_stats_noop) noop_calls = stats->funcs[f].calls;
+        if (stats->funcs[f].func == &cexitstack_func_free) free_calls = stats->funcs[f].calls;
+    }
+    assert( noop_calls == 1 && free_calls == 2 );
+    FILE *out = tmpfile();
+    assert( out && cexitstack_stats_dump( out ) );
+    rewind( out );
+    assert( fgetc( out ) == '{' );
+    fclose( out );
+    cexitstack_stats_reset();
+    cexitstack_stats_get( stats );
+    assert( stats->pushes == 0 && stats->funcs[0].calls == 0 );
+    free( stats );
+}
+#endif
+
+#ifdef CEXITSTACK_DEBUG
+#define TEST_DEBUG_MAX_ANOMALIES 4
+static cexitstack_debug_anomaly test_debug_anomalies[TEST_DEBUG_MAX_ANOMALIES];
+static unsigned int test_debug_anomaly_count;
+
+static void test_debug_record( const cexitstack_debug_anomaly *anomaly )
+{
+    if (test_debug_anomaly_count < TEST_DEBUG_MAX_ANOMALIES)
+        test_debug_anomalies[test_debug_anomaly_count] = *anomaly;
+    test_debug_anomaly_count++;
+}
+
+static int test_debug_leak_thread( void *arg )
+{
+    *(cexitstack **)arg = cexitstack_new( 0 );
+    return 0;
+}
+
+void test_debug_leaks( void )
+{
+    cexitstack_debug_set_handler( &test_debug_record );
+    cexitstack_debug_check();
+    test_debug_anomaly_count = 0;
+    unsigned int live = cexitstack_debug_live();
+    cexitstack stack;
+    int line = __LINE__ + 1;
+    assert( cexitstack_init( &stack, 0 ) );
+    cexitstack *heap = cexitstack_new( 0 );
+    assert( heap && cexitstack_debug_live() == live + 2 );
+    assert( cexitstack_return( heap, 0, CEXITSTACK_CONDITION_ALWAYS ) == 0 );
+    assert( cexitstack_debug_live() == live + 1 );
+    // reported once, with the call site
+    assert( cexitstack_debug_check() == 1 && cexitstack_debug_check() == 0 );
+    assert( test_debug_anomaly_count == 1 && test_debug_anomalies[0].kind == CEXITSTACK_DEBUG_LEAK );
+    assert( test_debug_anomalies[0].stack == &stack && test_debug_anomalies[0].line == line );
+    assert( strstr( test_debug_anomalies[0].file, "test.c" ) );
+    cexitstack_free( &stack );
+    assert( cexitstack_debug_live() == live );
+
+    // a stack left alive by a thread is reported when the thread exits and can still be freed later
+    cexitstack *leaked = NULL;
+    thrd_t thread;
+    assert( thrd_create( &thread, &test_debug_leak_thread, &leaked ) == thrd_success );
+    assert( thrd_join( thread, NULL ) == thrd_success );
+    assert( leaked && test_debug_anomaly_count == 2 && test_debug_anomalies[1].kind == CEXITSTACK_DEBUG_LEAK );
+    assert( test_debug_anomalies[1].stack == leaked );
+    assert( cexitstack_return( leaked, 0, CEXITSTACK_CONDITION_ALWAYS ) == 0 );
+    cexitstack_debug_set_handler( NULL );
+}
+
+void test_debug_duplicates( void )
+{
+    cexitstack_debug_set_handler( &test_debug_record );
+    test_debug_anomaly_count = 0;
+    int v[4 * CEXITSTACK_DEBUG_SCAN_MAX] = { 0 };
+    cexitstack *stack = cexitstack_new( 0 );
+    assert( stack );
+    // same object with another cleanup, NULL objects and a single args item are fine
+    assert( cexitstack_push_full( stack, &v[0], CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    assert( cexitstack_push_full( stack, &v[0], 2, &cexitstack_func_free ) );
+    assert( cexitstack_push_full( stack, NULL, 2, &cexitstack_func_set ) );
+    assert( cexitstack_push_full( stack, NULL, 2, &cexitstack_func_set ) );
+    assert( cexitstack_push_args( stack, CEXITSTACK_ARGS( { .word = 1 }, { .size = 1001 } ), 2, &test_args_record ) );
+    assert( test_debug_anomaly_count == 0 );
+    assert( cexitstack_push_full( stack, &v[0], 4, &cexitstack_func_set ) );
+    assert( test_debug_anomaly_count == 1 && test_debug_anomalies[0].kind == CEXITSTACK_DEBUG_DUPLICATE );
+    assert( test_debug_anomalies[0].object == &v[0] && test_debug_anomalies[0].func == &cexitstack_func_set );
+    assert( test_debug_anomalies[0].previous_position == 0 && test_debug_anomalies[0].position == 6 );
+    assert( cexitstack_unwind_to( stack, 2, 0 ) );
+
+    // deep stacks are checked with the hash set; popped items don't count any more
+    for (int i = 1; i < 4 * CEXITSTACK_DEBUG_SCAN_MAX; i++)
+        assert( cexitstack_push_full( stack, &v[i], CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    unsigned int mark = 2 + 2 * CEXITSTACK_DEBUG_SCAN_MAX;
+    assert( cexitstack_unwind_to( stack, mark, CEXITSTACK_CONDITION_ALWAYS ) );
+    for (int i = 2 * CEXITSTACK_DEBUG_SCAN_MAX + 1; i < 4 * CEXITSTACK_DEBUG_SCAN_MAX; i++)
+        assert( cexitstack_push_full( stack, &v[i], CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    assert( test_debug_anomaly_count == 1 );
+    void *objects[2] = { &v[3], &mark };
+    assert( cexitstack_push_many( stack, objects, 2, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set ) );
+    assert( test_debug_anomaly_count == 2 && test_debug_anomalies[1].object == &v[3] && test_debug_anomalies[1].previous_position == 4 );
+    assert( cexitstack_return( stack, 0, 0 ) == 0 );
+    cexitstack_debug_set_handler( NULL );
+}
+
+// args items are told apart by their payload, rollback items are checked within their segment
+void test_debug_duplicates_args_rollback( void )
+{
+    cexitstack_debug_set_handler( &test_debug_record );
+    test_debug_anomaly_count = 0;
+    static char pages[2][4096];
+    int v[2] = { 0 };
+    cexitstack *stack = cexitstack_new( 0 );
+    assert( stack );
+#ifndef _WIN32
+    // condition 2 never runs, so nothing is unmapped
+    assert( cexitstack_push_mapping( stack, pages[0], sizeof( pages[0] ), 2 ) );
+    assert( cexitstack_push_mapping( stack, pages[0], 2 * sizeof( pages[0] ), 2 ) );
+    assert( cexitstack_push_mapping( stack, pages[1], sizeof( pages[1] ), 2 ) );
+    assert( test_debug_anomaly_count == 0 );
+    assert( cexitstack_push_mapping( stack, pages[0], sizeof( pages[0] ), 2 ) );
+    assert( test_debug_anomaly_count == 1 && test_debug_anomalies[0].object == pages[0] );
+    assert( test_debug_anomalies[0].func == (cexitstack_func *)&cexitstack_args_munmap );
+    assert( test_debug_anomalies[0].previous_position == 1 && test_debug_anomalies[0].position == 7 && !test_debug_anomalies[0].rollback );
+    assert( cexitstack_unwind_to( stack, 0, 0 ) );
+    test_debug_anomaly_count = 0;
+#endif
+    // deep stacks, checked with the hash set
+    for (int i = 0; i < 2 * CEXITSTACK_DEBUG_SCAN_MAX; i++)
+        assert( cexitstack_push_args( stack, CEXITSTACK_ARGS( { .word = 1 }, { .size = 1000 + (size_t)i } ), 2, &test_args_record ) );
+    assert( test_debug_anomaly_count == 0 );
+    assert( cexitstack_push_args( stack, CEXITSTACK_ARGS( { .word = 1 }, { .size = 1003 } ), 2, &test_args_record ) );
+    assert( test_debug_anomaly_count == 1 && test_debug_anomalies[0].previous_position == 7 );
+    assert( test_debug_anomalies[0].position == 4 * CEXITSTACK_DEBUG_SCAN_MAX + 1 );
+
+    assert( cexitstack_push_rollback( stack, &v[0], CEXITSTACK_CONDITION_ERROR, &cexitstack_func_set ) );
+    assert( cexitstack_push_rollback( stack, &v[1], CEXITSTACK_CONDITION_ERROR, &cexitstack_func_set ) );
+    assert( cexitstack_push_rollback( stack, &v[0], CEXITSTACK_CONDITION_ERROR, &cexitstack_func_free ) );
+    assert( test_debug_anomaly_count == 1 );
+    assert( cexitstack_push_rollback( stack, &v[0], 2, &cexitstack_func_set ) );
+    assert( test_debug_anomaly_count == 2 && test_debug_anomalies[1].rollback && test_debug_anomalies[1].object == &v[0] );
+    assert( test_debug_anomalies[1].previous_position == 0 && test_debug_anomalies[1].position == 3 );
+    // committed items are gone
+    cexitstack_commit( stack );
+    assert( cexitstack_push_rollback( stack, &v[0], CEXITSTACK_CONDITION_ERROR, &cexitstack_func_set ) );
+    assert( test_debug_anomaly_count == 2 );
+    assert( cexitstack_return( stack, 0, 0 ) == 0 );
+    cexitstack_debug_set_handler( NULL );
+}
+
+#ifdef __linux__
+static void test_debug_overflow_exit( const cexitstack_debug_anomaly *anomaly )
+{
+    _exit( anomaly->kind == CEXITSTACK_DEBUG_OVERFLOW && anomaly->capacity == 1 && strstr( anomaly->file, "test.c" ) ? 42 : 1 );
+}
+
+// the diagnostic runs before abort(), in a child so the abort doesn't end the tests
+void test_debug_overflow( void )
+{
+    pid_t child = fork();
+    assert( child >= 0 );
+    if (child == 0) {
+        cexitstack_debug_set_handler( &test_debug_overflow_exit );
+        int i = 0;
+        CEXITSTACK( stack, 1 );
+        CEXITSTACK_PUSH( stack, &i, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set );
+        CEXITSTACK_PUSH( stack, &i, CEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set );
+        _exit( 0 );
+    }
+    int status;
+    assert( waitpid( child, &status, 0 ) == child && WIFEXITED( status ) && WEXITSTATUS( status ) == 42 );
+}
+#endif
+#endif
+
+#ifndef CEXITSTACK_NO_GLIB
 void test_new_g( void )
 {
     gexitstack *stack = gexitstack_new();
@@ -276,7 +1770,7 @@ void test_push_one_struct_g( void )
     stack = gexitstack_push_struct( stack, &item );
     assert( stack );
     assert( stack->len == 1 );
-    gexitstack_item *it = &g_array_index( stack, gexitstack_item, 0 );
+    gexitstack_item *it = &stack->data[0];
     assert( it->condition == 1 && it->func == &cexitstack_func_set && it->object == &i );
     assert( *(int *)( it->object ) == i );
     gexitstack_free( &stack );
@@ -290,7 +1784,7 @@ void test_push_one_full_g( void )
     stack = gexitstack_push_full( stack, &i, 1, &cexitstack_func_set );
     assert( stack );
     assert( stack->len == 1 );
-    gexitstack_item *it = &g_array_index( stack, gexitstack_item, 0 );
+    gexitstack_item *it = &stack->data[0];
     assert( it->condition == 1 && it->func == &cexitstack_func_set && it->object == &i );
     assert( *(int *)( it->object ) == i );
     gexitstack_free( &stack );
@@ -313,16 +1807,131 @@ void test_push_multiple_g( void )
         v[i] = 10 + i;
         stack = gexitstack_push( stack, &v[i], 1, &cexitstack_func_set );
         assert( stack );
-        assert( stack->len == i + 1 );
+        assert( stack->len == (guint)i + 1 );
     }
     for (int i = 0; i < TEST_PUSH_MULTIPLE_N; i++) {
-        gexitstack_item *it = &g_array_index( stack, gexitstack_item, i );
+        gexitstack_item *it = &stack->data[i];
         assert( it->condition == 1 && it->func == &cexitstack_func_set && it->object == &v[i] );
         assert( *(int *)( it->object ) == 10 + i );
     }
     gexitstack_free( &stack );
 }
 
+void test_return_g_free_run_g( void )
+{
+    gexitstack *stack = gexitstack_new();
+    assert( stack );
+    int results[3] = { 0 };
+    guint conditions[3] = { GEXITSTACK_CONDITION_ALWAYS, 1, 2 };
+    for (int i = 0; i < 3; i++) {
+        gexitstack_push( stack, results + i, conditions[i], &cexitstack_func_set );
+        for (int j = 0; j < 4; j++)
+            gexitstack_push( stack, g_malloc( 16 ), GEXITSTACK_CONDITION_ALWAYS, g_free );
+        gexitstack_push( stack, g_malloc( 16 ), 1 | 2, g_free );
+    }
+    assert( gexitstack_return( stack, -1, 1 ) == -1 );
+    assert( results[0] == 1 && results[1] == 1 && results[2] == 0 );
+}
+
+void test_mark_unwind_to_g( void )
+{
+    gexitstack *stack = gexitstack_new();
+    assert( stack );
+    int kept = 0;
+    gexitstack_push( stack, &kept, GEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set );
+    guint mark = gexitstack_mark( stack );
+    assert( mark == 1 );
+    for (int iteration = 0; iteration < 3; iteration++) {
+        int results[TEST_RETURN_SET_N] = { 0 };
+        guint conditions[TEST_RETURN_SET_N] = { 2, GEXITSTACK_CONDITION_ALWAYS, 1, 4, 2 };
+        int expect[TEST_RETURN_SET_N] = { 1, 1, 0, 0, 1 };
+        for (int i = 0; i < TEST_RETURN_SET_N; i++)
+            gexitstack_push( stack, results + i, conditions[i], &cexitstack_func_set );
+        gexitstack_push( stack, g_malloc( 16 ), GEXITSTACK_CONDITION_ALWAYS, g_free );
+        assert( gexitstack_unwind_to( stack, mark, 2 ) );
+        assert( stack->len == mark );
+        for (int i = 0; i < TEST_RETURN_SET_N; i++)
+            assert( results[i] == expect[i] );
+        assert( kept == 0 );
+    }
+    assert( gexitstack_unwind_to( stack, mark + 1, 2 ) == 0 );
+    assert( gexitstack_return( stack, -1, 0 ) == -1 );
+    assert( kept == 1 );
+}
+
+void test_push_many_g( void )
+{
+    gexitstack *stack = gexitstack_new();
+    assert( stack );
+    int v[TEST_PUSH_MANY_N] = { 0 };
+    gpointer pointers[TEST_PUSH_MANY_N];
+    for (int i = 0; i < TEST_PUSH_MANY_N; i++)
+        pointers[i] = &v[i];
+    stack = gexitstack_push_full( stack, NULL, 0, &cexitstack_func_set );
+    stack = gexitstack_push_many( stack, pointers, TEST_PUSH_MANY_N, 1, &cexitstack_func_set );
+    assert( stack );
+    assert( stack->len == TEST_PUSH_MANY_N + 1 );
+    for (int i = 0; i < TEST_PUSH_MANY_N; i++) {
+        gexitstack_item *it = &stack->data[i + 1];
+        assert( it->condition == 1 && it->func == &cexitstack_func_set && it->object == &v[i] );
+    }
+    assert( gexitstack_return( stack, -1, 1 ) == -1 );
+    for (int i = 0; i < TEST_PUSH_MANY_N; i++)
+        assert( v[i] == 1 );
+}
+
+void test_grow_g( void )
+{
+    gexitstack *stack = gexitstack_new();
+    assert( stack );
+    int v[3 * GEXITSTACK_DEFAULT_INITIAL_CAPACITY] = { 0 };
+    // fills the inline items, then moves to a heap array that grows while the stack is in use
+    for (int i = 0; i < GEXITSTACK_DEFAULT_INITIAL_CAPACITY; i++)
+        gexitstack_push( stack, &v[i], GEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set );
+    assert( stack->data == stack->inline_items && stack->capacity == GEXITSTACK_DEFAULT_INITIAL_CAPACITY );
+    gexitstack_push( stack, NULL, GEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set );
+    assert( stack->data != stack->inline_items && stack->capacity >= GEXITSTACK_DEFAULT_INITIAL_CAPACITY + 1 );
+    guint mark = gexitstack_mark( stack );
+    for (int i = GEXITSTACK_DEFAULT_INITIAL_CAPACITY; i < 3 * GEXITSTACK_DEFAULT_INITIAL_CAPACITY; i++)
+        gexitstack_push( stack, &v[i], GEXITSTACK_CONDITION_ALWAYS, &cexitstack_func_set );
+    assert( stack->len == 3 * GEXITSTACK_DEFAULT_INITIAL_CAPACITY + 1 && stack->capacity >= stack->len );
+    assert( gexitstack_unwind_to( stack, mark, GEXITSTACK_CONDITION_ALWAYS ) );
+    for (int i = 0; i < 3 * GEXITSTACK_DEFAULT_INITIAL_CAPACITY; i++)
+        assert( v[i] == ( i >= GEXITSTACK_DEFAULT_INITIAL_CAPACITY ) );
+    for (int i = 0; i < GEXITSTACK_DEFAULT_INITIAL_CAPACITY; i++)
+        assert( stack->data[i].object == &v[i] );
+    // the NULL object is skipped
+    assert( gexitstack_return( stack, -1, GEXITSTACK_CONDITION_ALWAYS ) == -1 );
+    for (int i = 0; i < 3 * GEXITSTACK_DEFAULT_INITIAL_CAPACITY; i++)
+        assert( v[i] == 1 );
+}
+
+static gexitstack *test_len_stack;
+
+static void test_len_record( gpointer object )
+{
+    *(guint *)object = test_len_stack->len;
+}
+
+// a cleanup sees the stack without its own item and the ones unwound before it
+void test_unwind_len_g( void )
+{
+    gexitstack *stack = gexitstack_new();
+    assert( stack );
+    test_len_stack = stack;
+    guint lens[4] = { 0 };
+    gexitstack_push( stack, &lens[0], GEXITSTACK_CONDITION_ALWAYS, &test_len_record );
+    guint mark = gexitstack_mark( stack );
+    gexitstack_push( stack, &lens[1], 1, &test_len_record );
+    gexitstack_push( stack, g_malloc( 16 ), 1, g_free );
+    gexitstack_push( stack, &lens[2], 2, &test_len_record );
+    gexitstack_push( stack, &lens[3], 1, &test_len_record );
+    assert( gexitstack_unwind_to( stack, mark, 1 ) );
+    assert( stack->len == mark && lens[3] == 4 && lens[2] == 0 && lens[1] == 1 );
+    assert( gexitstack_return( stack, -1, 1 ) == -1 );
+    assert( lens[0] == 0 );
+}
+
 void test_free_g( void )
 {
     gexitstack *stack = gexitstack_new();
@@ -348,7 +1957,7 @@ void test_return_empty_g()
 {
     gexitstack *stack = gexitstack_new();
     assert( stack );
-    gint r = gexitstack_return( stack, 1, GEXITSTACK_CONDITION_ALWAYS );
+    assert( gexitstack_return( stack, 1, GEXITSTACK_CONDITION_ALWAYS ) == 1 );
 }
 
 void test_return_one_condition_g()
@@ -394,9 +2003,9 @@ void test_return_multiple_conditions_partial_g()
     for (int i = 0; i < TEST_RETURN_SET_N; i++)
         assert( results[i] == expect[i] );
 }
+#endif
 
-
-int main( int argc, char **argv )
+int main( void )
 {
     test_new_default();
     test_new();
@@ -407,24 +2016,93 @@ int main( int argc, char **argv )
     test_push_multiple_struct();
     test_push_multiple_full();
     test_realloc();
+    test_growth_geometric();
+    test_growth_linear();
+    test_reserve();
+    test_push_many();
+    test_push_args();
+#ifdef __linux__
+    test_push_kinds();
+#endif
     test_faulty_input();
     test_cexitstack_func_free();
     test_return_one_condition();
     test_return_multiple_conditions_all();
     test_return_multiple_conditions_partial();
     test_return_free_empty();
+    test_return_batch_free();
+    test_return_batch_free_library();
+    test_mark_unwind_to();
+    test_rollback_unwind();
+    test_rollback_commit();
+    test_rollback_only_return();
+    test_unwind_budget_items();
+    test_unwind_budget_time();
+    test_reset();
+    test_reset_shrink();
     test_generic_push_macro();
+    test_inline_init();
+    test_inline_spill();
+    test_inline_return();
+    test_inline_return_no_spill();
+    test_arena_recycle();
+    test_reset_shrink_arena();
+    test_scope_nested();
+    test_scope_defer_from_cleanup();
     test_macro_init();
     test_macro_push();
     test_macro_return();
+    test_macro_args();
+#ifdef CEXITSTACK_SCOPED
+    test_scoped_init();
+    test_scoped_push();
+    test_scoped_return();
+    test_scoped_block_exit();
+    test_scoped_macro_return();
+#endif
+    test_compact_init();
+    test_compact_push();
+    test_compact_func_table_full();
+    test_compact_return();
+    test_compact_return_many();
+    test_concurrent_return();
+    test_concurrent_stress();
+    test_return_parallel();
+    test_return_deferred();
+    test_return_deferred_args_batch();
+    test_context_switch();
+#ifdef __linux__
+    test_context_tasks_cancel();
+    test_persist_unwind();
+    test_persist_replay();
+    test_persist_torn();
+#endif
+#ifdef CEXITSTACK_STATS
+    test_stats();
+#endif
+#ifdef CEXITSTACK_DEBUG
+    test_debug_leaks();
+    test_debug_duplicates();
+    test_debug_duplicates_args_rollback();
+#ifdef __linux__
+    test_debug_overflow();
+#endif
+#endif
+#ifndef CEXITSTACK_NO_GLIB
     test_new_g();
     test_free_empty_g();
     test_push_one_struct_g();
     test_push_one_full_g();
     test_push_multiple_g();
+    test_push_many_g();
+    test_return_g_free_run_g();
+    test_mark_unwind_to_g();
+    test_grow_g();
+    test_unwind_len_g();
     test_free_g();
     test_return_empty_g();
     test_return_one_condition_g();
     test_return_one_condition_partial_g();
     test_return_multiple_conditions_partial_g();
+#endif
 }